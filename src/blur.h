@@ -0,0 +1,275 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include "png_files.h"
+#include "parallel.h"
+#include "pixel_ops.h"
+
+// Blurs whose cost per pixel does not depend on the radius: a sliding
+// window box, iterated boxes approximating a Gaussian, and a recursive
+// (Young - van Vliet) Gaussian. Edges are extended by repeating the border
+// pixels. channels = 3 keeps the source alpha.
+//
+// Every blur is a pass along rows, run twice with a transpose after each
+// run: the vertical pass walks rows of the transposed image, so both
+// passes stream through memory and rows are split across threads.
+
+// Runs pass(in, out, length) over the rows, then over the columns of src.
+// in and out never overlap. Rows are processed in bands of TRANSPOSE_TILE:
+// a band is blurred into a small buffer and transposed from there, so the
+// only full size buffer is the transposed image between the two passes.
+template<typename Pass>
+void separable_blur(Image const& src, Image& out, Pass const& pass) {
+    if (!out.pixels)
+        src.same(out);
+    if (out.width != src.width || out.height != src.height) abort();
+
+    int const width = src.width, height = src.height;
+
+    // Blur rows [from, to) of in into band, then transpose band into
+    // columns [from, to) of dst
+    auto run_bands = [&](int length, int count, auto in_row, png_bytep* dst) {
+        int bands = (count + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+        parallel_for(0, bands, [&](int band_from, int band_to) {
+            std::vector<png_byte> band(size_t(TRANSPOSE_TILE) * length * 4);
+            std::vector<png_byte> scratch(size_t(length) * 4);
+            std::vector<uint32_t const*> band_rows(TRANSPOSE_TILE);
+            std::vector<uint32_t*> dst_rows(length);
+
+            for (int b = band_from; b < band_to; ++b) {
+                int from = b * TRANSPOSE_TILE, to = std::min(from + TRANSPOSE_TILE, count);
+                for (int i = from; i < to; ++i) {
+                    png_bytep row = &band[size_t(i - from) * length * 4];
+                    pass(in_row(i, scratch.data()), row, length);
+                    band_rows[i - from] = (uint32_t const*)row;
+                }
+
+                for (int y = 0; y < length; ++y)
+                    dst_rows[y] = (uint32_t*)dst[y] + from;
+                transpose_pixels(dst_rows.data(), band_rows.data(), to - from, 0, length);
+            }
+        });
+    };
+
+    Image columns(height, width);
+    run_bands(width, height, [&](int y, png_bytep scratch) { return src.row(y, scratch); }, columns.pixels);
+
+    // src is done with, out may be the same image
+    out.materialize();
+    run_bands(height, width, [&](int x, png_bytep) { return (png_const_bytep)columns.pixels[x]; }, out.pixels);
+}
+
+// Sliding window box filters of the given radii, applied one after the
+// other to a row. Each step adds the pixel entering the window and
+// subtracts the one leaving it; the four channels of a pixel are one
+// SSE2 vector. Sums are exact, the division is one float multiply.
+// With several boxes the row is first padded by their total radius, so
+// later boxes see the extended output of earlier ones, not its clamp.
+struct BoxPass {
+    std::vector<int> radii;
+    int channels;
+
+    void operator()(png_const_bytep in, png_bytep out, int length) const {
+        if (radii.size() == 1) {
+            box_row(in, out, length, radii[0]);
+        } else {
+            int pad = 0;
+            for (int r : radii)
+                pad += r;
+            int padded = length + 2 * pad;
+
+            thread_local std::vector<uint32_t> buffers[2];
+            for (auto& buffer : buffers)
+                buffer.resize(padded);
+
+            uint32_t const* pixels = (uint32_t const*)in;
+            std::fill(buffers[0].begin(), buffers[0].begin() + pad, pixels[0]);
+            std::copy(pixels, pixels + length, buffers[0].begin() + pad);
+            std::fill(buffers[0].begin() + pad + length, buffers[0].end(), pixels[length - 1]);
+
+            for (size_t pass = 0; pass < radii.size(); ++pass)
+                box_row((png_const_bytep)buffers[pass & 1].data(), (png_bytep)buffers[~pass & 1].data(), padded, radii[pass]);
+            std::copy(buffers[radii.size() & 1].begin() + pad, buffers[radii.size() & 1].begin() + pad + length, (uint32_t*)out);
+        }
+
+        if (channels == 3)
+            for (int x = 0; x < length; ++x)
+                out[x * 4 + 3] = in[x * 4 + 3];
+    }
+
+    static void box_row(png_const_bytep in, png_bytep out, int length, int radius) {
+        float const inverse = 1.f / float(2 * radius + 1);
+        int const last = length - 1;
+
+        int sum[4] = { 0, 0, 0, 0 };
+        for (int i = -radius; i <= radius; ++i) {
+            png_const_bytep px = &(in[std::max(0, std::min(i, last)) * 4]);
+            for (int c = 0; c < 4; ++c)
+                sum[c] += px[c];
+        }
+
+#ifdef PIXEL_OPS_SSE2
+        __m128i const zero = _mm_setzero_si128();
+        __m128 const v_inverse = _mm_set1_ps(inverse), half = _mm_set1_ps(0.5f);
+        __m128i v_sum = _mm_loadu_si128((__m128i const*)sum);
+        auto load = [&](int x) {
+            __m128i px = _mm_cvtsi32_si128(*(int const*)(in + x * 4));
+            return _mm_unpacklo_epi16(_mm_unpacklo_epi8(px, zero), zero);
+        };
+        auto step = [&](int x, int enter, int leave) {
+            __m128i v = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(v_sum), v_inverse), half));
+            v = _mm_packs_epi32(v, v);
+            *(int*)(out + x * 4) = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+            v_sum = _mm_add_epi32(v_sum, _mm_sub_epi32(load(enter), load(leave)));
+        };
+#else
+        auto step = [&](int x, int enter, int leave) {
+            for (int c = 0; c < 4; ++c) {
+                out[x * 4 + c] = png_byte(int(float(sum[c]) * inverse + 0.5f));
+                sum[c] += in[enter * 4 + c] - in[leave * 4 + c];
+            }
+        };
+#endif
+
+        // Pixels entering and leaving the window are clamped to the row
+        // only near its ends
+        int const left = std::min(radius, length), right = std::max(left, length - radius - 1);
+        for (int x = 0; x < left; ++x)
+            step(x, std::min(x + radius + 1, last), 0);
+        for (int x = left; x < right; ++x)
+            step(x, x + radius + 1, x - radius);
+        for (int x = right; x < length; ++x)
+            step(x, std::min(x + radius + 1, last), std::max(x - radius, 0));
+    }
+};
+
+inline void box_blur(Image const& src, Image& out, int radius, int channels = 4) {
+    separable_blur(src, out, BoxPass{ { radius }, channels });
+}
+
+// Radii of `passes` boxes whose combined variance is closest to sigma^2:
+// the widest odd width below the ideal one, with some boxes two wider
+inline std::vector<int> gaussian_box_radii(float sigma, int passes) {
+    float ideal = std::sqrt(12 * sigma * sigma / passes + 1);
+    int lower = int(std::floor(ideal));
+    if (lower % 2 == 0)
+        --lower;
+    int upper = lower + 2;
+
+    float m_ideal = (12 * sigma * sigma - passes * lower * lower - 4 * passes * lower - 3 * passes) / (-4.f * lower - 4);
+    int m = int(std::round(m_ideal));
+
+    std::vector<int> radii;
+    for (int i = 0; i < passes; ++i)
+        radii.push_back(((i < m ? lower : upper) - 1) / 2);
+    return radii;
+}
+
+// Gaussian approximated by iterated box blurs, 3 passes are within a few
+// percent of the true curve
+inline void box_gaussian_blur(Image const& src, Image& out, float sigma, int passes = 3, int channels = 4) {
+    separable_blur(src, out, BoxPass{ gaussian_box_radii(sigma, passes), channels });
+}
+
+// Third order recursive Gaussian (Young and van Vliet, 1995): a causal
+// pass followed by an anticausal one, 3 multiply-adds each per value.
+// The four channels of a pixel are one SSE vector.
+//
+// The causal pass starts in the steady state of the repeated first pixel.
+// It then runs on past the end of the row over the repeated last pixel
+// until its response has died out, so the anticausal pass can start in the
+// steady state too and both edges see a constant extension.
+struct RecursiveGaussianPass {
+    float B, b1, b2, b3;
+    int tail, channels;
+
+    RecursiveGaussianPass(float sigma, int _channels) : channels(_channels) {
+        sigma = std::max(sigma, 0.5f);
+        float q = sigma >= 2.5f ? 0.98711f * sigma - 0.96330f : 3.97156f - 4.14554f * std::sqrt(1 - 0.26891f * sigma);
+        float q2 = q * q, q3 = q2 * q;
+
+        float b0 = 1.57825f + 2.44413f * q + 1.4281f * q2 + 0.422205f * q3;
+        b1 = (2.44413f * q + 2.85619f * q2 + 1.26661f * q3) / b0;
+        b2 = -(1.4281f * q2 + 1.26661f * q3) / b0;
+        b3 = 0.422205f * q3 / b0;
+        B = 1 - (b1 + b2 + b3);
+        tail = int(std::ceil(6 * sigma)) + 8;
+    }
+
+    void operator()(png_const_bytep in, png_bytep out, int length) const {
+        thread_local std::vector<float> causal;
+        causal.resize(size_t(length + tail) * 4);
+        float* w = causal.data();
+        int const last = length - 1;
+
+#ifdef PIXEL_OPS_SSE2
+        __m128i const zero = _mm_setzero_si128();
+        __m128 const vB = _mm_set1_ps(B), v1 = _mm_set1_ps(b1), v2 = _mm_set1_ps(b2), v3 = _mm_set1_ps(b3);
+        auto load = [&](int x) {
+            __m128i px = _mm_cvtsi32_si128(*(int const*)(in + std::min(x, last) * 4));
+            return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(px, zero), zero));
+        };
+        auto filter = [&](__m128 x, __m128& p1, __m128& p2, __m128& p3) {
+            __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vB, x), _mm_mul_ps(v1, p1)),
+                _mm_add_ps(_mm_mul_ps(v2, p2), _mm_mul_ps(v3, p3)));
+            p3 = p2, p2 = p1, p1 = v;
+            return v;
+        };
+
+        __m128 p1 = load(0), p2 = p1, p3 = p1;
+        for (int x = 0; x < length + tail; ++x)
+            _mm_storeu_ps(w + size_t(x) * 4, filter(load(x), p1, p2, p3));
+
+        p1 = p2 = p3 = load(last);
+        for (int x = length + tail - 1; x >= length; --x)
+            filter(_mm_loadu_ps(w + size_t(x) * 4), p1, p2, p3);
+
+        __m128 const half = _mm_set1_ps(0.5f), top = _mm_set1_ps(255.f);
+        for (int x = last; x >= 0; --x) {
+            __m128 v = filter(_mm_loadu_ps(w + size_t(x) * 4), p1, p2, p3);
+            __m128i i = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(v, half), _mm_setzero_ps()), top));
+            i = _mm_packs_epi32(i, i);
+            *(int*)(out + x * 4) = _mm_cvtsi128_si32(_mm_packus_epi16(i, i));
+        }
+#else
+        float p1[4], p2[4], p3[4];
+        auto filter = [&](float const* x, int c) {
+            float v = (B * x[c] + b1 * p1[c]) + (b2 * p2[c] + b3 * p3[c]);
+            p3[c] = p2[c], p2[c] = p1[c], p1[c] = v;
+            return v;
+        };
+
+        for (int c = 0; c < 4; ++c)
+            p1[c] = p2[c] = p3[c] = in[c];
+        for (int x = 0; x < length + tail; ++x) {
+            float px[4];
+            for (int c = 0; c < 4; ++c)
+                px[c] = in[std::min(x, last) * 4 + c];
+            for (int c = 0; c < 4; ++c)
+                w[size_t(x) * 4 + c] = filter(px, c);
+        }
+
+        for (int c = 0; c < 4; ++c)
+            p1[c] = p2[c] = p3[c] = in[last * 4 + c];
+        for (int x = length + tail - 1; x >= length; --x)
+            for (int c = 0; c < 4; ++c)
+                filter(w + size_t(x) * 4, c);
+
+        for (int x = last; x >= 0; --x)
+            for (int c = 0; c < 4; ++c) {
+                float v = filter(w + size_t(x) * 4, c);
+                out[x * 4 + c] = png_byte(std::min(std::max(v + 0.5f, 0.f), 255.f));
+            }
+#endif
+
+        if (channels == 3)
+            for (int x = 0; x < length; ++x)
+                out[x * 4 + 3] = in[x * 4 + 3];
+    }
+};
+
+inline void recursive_gaussian_blur(Image const& src, Image& out, float sigma, int channels = 4) {
+    separable_blur(src, out, RecursiveGaussianPass(sigma, channels));
+}
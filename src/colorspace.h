@@ -0,0 +1,609 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include "png_files.h"
+#include "parallel.h"
+#include "pixel_ops.h"
+
+// Colour space conversions of RGBA images. Alpha is always carried over.
+//
+// Linear maps (gray, YCbCr) are one fixed point 3 x 3 matrix pass, four
+// pixels per step with SSE2. HSV and HSL stay in bytes, eight pixels per
+// step with SSE2. Linear light and CIE Lab do not fit bytes and go to a
+// FloatImage; those passes are scalar.
+//
+// Byte encodings: YCbCr is full range BT.601 (as in JPEG), Y in R, Cb in
+// G, Cr in B. Hue takes the whole byte, 256 steps to the circle, then S
+// and V (or L).
+
+inline float srgb_to_linear(float c) {
+    return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+inline float linear_to_srgb(float c) {
+    return c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.f / 2.4f) - 0.055f;
+}
+
+// Interleaved four channel float image, for values that do not fit bytes
+struct FloatImage {
+    int width = 0, height = 0;
+    std::vector<float> pixels;
+
+    FloatImage() {}
+
+    FloatImage(int _width, int _height) {
+        create(_width, _height);
+    }
+
+    void create(int _width, int _height) {
+        width = _width;
+        height = _height;
+        pixels.assign(size_t(width) * height * 4, 0.f);
+    }
+
+    float* row(int y) {
+        return &pixels[size_t(y) * width * 4];
+    }
+
+    float const* row(int y) const {
+        return &pixels[size_t(y) * width * 4];
+    }
+};
+
+// Runs func(in, out, width) over the rows of src into out, which can be
+// src itself. As everywhere in this header, an empty out is allocated to
+// the size of src and an out of another size aborts.
+template<typename Func>
+void convert_rows(Image const& src, Image& out, Func func) {
+    if (!out.pixels)
+        src.same(out);
+    if (out.width != src.width || out.height != src.height) abort();
+    // In place: the orientation of both is applied once
+    out.materialize();
+
+    parallel_for(0, src.height, [&](int from, int to) {
+        std::vector<png_byte> scratch(size_t(src.width) * 4);
+        for (int y = from; y < to; ++y)
+            func(src.row(y, scratch.data()), out.pixels[y], src.width);
+    }, 16);
+}
+
+// out = m * (R, G, B) + offset, rounded and clamped. Coefficients are
+// fixed point with COLOR_MATRIX_BITS fractional bits and |m| < 2.
+const int COLOR_MATRIX_BITS = 14;
+
+struct ColorMatrix {
+    int16_t m[3][3];
+    int bias[3];
+
+    ColorMatrix(float const (&matrix)[3][3], float const (&offset)[3]) {
+        float const one = float(1 << COLOR_MATRIX_BITS);
+        for (int i = 0; i < 3; ++i) {
+            int sum = 0;
+            for (int k = 0; k < 3; ++k) {
+                if (std::fabs(matrix[i][k]) >= 2.f) abort();
+                m[i][k] = int16_t(std::lround(matrix[i][k] * one));
+                sum += m[i][k];
+            }
+            // Rows that add up to 1 keep gray exact
+            float total = matrix[i][0] + matrix[i][1] + matrix[i][2];
+            if (std::fabs(total - 1.f) < 1e-4f) {
+                int largest = 0;
+                for (int k = 1; k < 3; ++k)
+                    if (std::abs(m[i][k]) > std::abs(m[i][largest]))
+                        largest = k;
+                m[i][largest] += int16_t((1 << COLOR_MATRIX_BITS) - sum);
+            }
+            bias[i] = int(std::lround(offset[i] * one)) + (1 << (COLOR_MATRIX_BITS - 1));
+        }
+    }
+
+    void operator()(png_const_bytep in, png_bytep out, int width) const {
+        int x = 0;
+
+#ifdef PIXEL_OPS_SSE2
+        // A pixel widened to 16 bits is (R, G, B, A); pmaddwd against
+        // (m0, m1, m2, 0) leaves R m0 + G m1 and B m2 side by side
+        __m128i const zero = _mm_setzero_si128();
+        __m128i weights[3], biases[3];
+        for (int i = 0; i < 3; ++i) {
+            weights[i] = _mm_setr_epi16(m[i][0], m[i][1], m[i][2], 0, m[i][0], m[i][1], m[i][2], 0);
+            biases[i] = _mm_set1_epi32(bias[i]);
+        }
+        __m128i const alpha_mask = _mm_set1_epi32(int(0xFF000000u));
+
+        for (; x + 4 <= width; x += 4) {
+            __m128i px = _mm_loadu_si128((__m128i const*)(in + x * 4));
+            __m128i lo = _mm_unpacklo_epi8(px, zero), hi = _mm_unpackhi_epi8(px, zero);
+
+            __m128i channel[3];
+            for (int i = 0; i < 3; ++i) {
+                __m128 a = _mm_castsi128_ps(_mm_madd_epi16(lo, weights[i]));
+                __m128 b = _mm_castsi128_ps(_mm_madd_epi16(hi, weights[i]));
+                __m128i sum = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))),
+                    _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+                channel[i] = _mm_srai_epi32(_mm_add_epi32(sum, biases[i]), COLOR_MATRIX_BITS);
+            }
+
+            // Planar R, G, B bytes back to pixels, alpha from the source
+            __m128i rg = _mm_packs_epi32(channel[0], channel[1]);
+            __m128i bz = _mm_packs_epi32(channel[2], zero);
+            __m128i planar = _mm_packus_epi16(rg, bz);
+            __m128i r_g = _mm_unpacklo_epi8(planar, _mm_srli_si128(planar, 4));
+            __m128i b_z = _mm_unpacklo_epi8(_mm_srli_si128(planar, 8), zero);
+            __m128i rgb = _mm_unpacklo_epi16(r_g, b_z);
+            _mm_storeu_si128((__m128i*)(out + x * 4), _mm_or_si128(rgb, _mm_and_si128(px, alpha_mask)));
+        }
+#endif
+
+        for (; x < width; ++x) {
+            png_const_bytep px = in + x * 4;
+            int v[3];
+            for (int i = 0; i < 3; ++i)
+                v[i] = (m[i][0] * px[0] + m[i][1] * px[1] + m[i][2] * px[2] + bias[i]) >> COLOR_MATRIX_BITS;
+            for (int i = 0; i < 3; ++i)
+                out[x * 4 + i] = png_byte(std::min(std::max(v[i], 0), 255));
+            out[x * 4 + 3] = px[3];
+        }
+    }
+};
+
+// BT.601 luma in all three channels
+inline ColorMatrix const& gray_matrix() {
+    static ColorMatrix const matrix({
+        { 0.299f, 0.587f, 0.114f },
+        { 0.299f, 0.587f, 0.114f },
+        { 0.299f, 0.587f, 0.114f },
+    }, { 0.f, 0.f, 0.f });
+    return matrix;
+}
+
+inline ColorMatrix const& rgb_to_ycbcr_matrix() {
+    static ColorMatrix const matrix({
+        { 0.299f, 0.587f, 0.114f },
+        { -0.168736f, -0.331264f, 0.5f },
+        { 0.5f, -0.418688f, -0.081312f },
+    }, { 0.f, 128.f, 128.f });
+    return matrix;
+}
+
+inline ColorMatrix const& ycbcr_to_rgb_matrix() {
+    static ColorMatrix const matrix({
+        { 1.f, 0.f, 1.402f },
+        { 1.f, -0.344136f, -0.714136f },
+        { 1.f, 1.772f, 0.f },
+    }, { -1.402f * 128.f, (0.344136f + 0.714136f) * 128.f, -1.772f * 128.f });
+    return matrix;
+}
+
+inline void apply_color_matrix(Image const& src, Image& out, ColorMatrix const& matrix) {
+    convert_rows(src, out, matrix);
+}
+
+inline void to_gray(Image const& src, Image& out) {
+    apply_color_matrix(src, out, gray_matrix());
+}
+
+inline void rgb_to_ycbcr(Image const& src, Image& out) {
+    apply_color_matrix(src, out, rgb_to_ycbcr_matrix());
+}
+
+inline void ycbcr_to_rgb(Image const& src, Image& out) {
+    apply_color_matrix(src, out, ycbcr_to_rgb_matrix());
+}
+
+// Rounded num * scale / (den * den_scale), den > 0. The SSE2 path does the
+// same float operations in the same order, so both give the same bytes.
+inline int hue_ratio(int num, float scale, int den, float den_scale) {
+    return int(float(num) * scale / (float(den) * den_scale) + 0.5f);
+}
+
+// Hue byte of a pixel whose largest channel is top and whose range
+// top - bottom is delta > 0: sixths of the circle from the top channel,
+// 256 / 6 steps per sixth
+inline int hue_byte(png_const_bytep px, int top, int delta) {
+    int sixths;
+    if (top == px[0])
+        sixths = px[1] - px[2];
+    else if (top == px[1])
+        sixths = 2 * delta + px[2] - px[0];
+    else
+        sixths = 4 * delta + px[0] - px[1];
+    if (sixths < 0)
+        sixths += 6 * delta;
+    return hue_ratio(sixths, 128.f, delta, 3.f) & 255;
+}
+
+// R, G, B of a hue with the given top and bottom channel values
+inline void hue_to_rgb(int hue, int top, int bottom, png_bytep out) {
+    int sixths = hue * 6;
+    int sector = sixths >> 8, fraction = sixths & 255;
+    int span = top - bottom;
+    // The channel between top and bottom, rising or falling
+    int rising = bottom + ((span * fraction + 128) >> 8);
+    int falling = bottom + ((span * (256 - fraction) + 128) >> 8);
+
+    int r, g, b;
+    switch (sector) {
+    case 0: r = top, g = rising, b = bottom; break;
+    case 1: r = falling, g = top, b = bottom; break;
+    case 2: r = bottom, g = top, b = rising; break;
+    case 3: r = bottom, g = falling, b = top; break;
+    case 4: r = rising, g = bottom, b = top; break;
+    default: r = top, g = bottom, b = falling; break;
+    }
+    out[0] = png_byte(r), out[1] = png_byte(g), out[2] = png_byte(b);
+}
+
+#ifdef PIXEL_OPS_SSE2
+// Eight pixels as 16-bit planes of R, G, B and A, and back
+inline void load_planes(png_const_bytep in, __m128i planes[4]) {
+    __m128i const low_byte = _mm_set1_epi32(0xFF);
+    __m128i a = _mm_loadu_si128((__m128i const*)in);
+    __m128i b = _mm_loadu_si128((__m128i const*)(in + 16));
+    for (int c = 0; c < 4; ++c)
+        planes[c] = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 8 * c), low_byte),
+            _mm_and_si128(_mm_srli_epi32(b, 8 * c), low_byte));
+}
+
+inline void store_planes(png_bytep out, __m128i r, __m128i g, __m128i b, __m128i a) {
+    __m128i rg = _mm_packus_epi16(r, g), ba = _mm_packus_epi16(b, a);
+    rg = _mm_unpacklo_epi8(rg, _mm_srli_si128(rg, 8));
+    ba = _mm_unpacklo_epi8(ba, _mm_srli_si128(ba, 8));
+    _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi16(rg, ba));
+    _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi16(rg, ba));
+}
+
+inline __m128i select_epi16(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// x / 255 for x in [0, 65407]
+inline __m128i divide_255_epu16(__m128i x) {
+    return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)), 8);
+}
+
+// hue_ratio of eight non-negative 16-bit lanes, den > 0
+inline __m128i hue_ratio_epi16(__m128i num, float scale, __m128i den, float den_scale) {
+    __m128i const zero = _mm_setzero_si128();
+    __m128 const v_scale = _mm_set1_ps(scale), v_den_scale = _mm_set1_ps(den_scale), half = _mm_set1_ps(0.5f);
+    auto ratio = [&](__m128i n, __m128i d) {
+        __m128 q = _mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(n), v_scale), _mm_mul_ps(_mm_cvtepi32_ps(d), v_den_scale));
+        return _mm_cvttps_epi32(_mm_add_ps(q, half));
+    };
+    return _mm_packs_epi32(ratio(_mm_unpacklo_epi16(num, zero), _mm_unpacklo_epi16(den, zero)),
+        ratio(_mm_unpackhi_epi16(num, zero), _mm_unpackhi_epi16(den, zero)));
+}
+
+// Hue, top and delta of eight pixels, hue 0 where delta is 0
+inline __m128i hue_epi16(__m128i const planes[4], __m128i& top, __m128i& delta) {
+    __m128i r = planes[0], g = planes[1], b = planes[2];
+    top = _mm_max_epi16(r, _mm_max_epi16(g, b));
+    delta = _mm_sub_epi16(top, _mm_min_epi16(r, _mm_min_epi16(g, b)));
+
+    __m128i top_r = _mm_cmpeq_epi16(top, r), top_g = _mm_cmpeq_epi16(top, g);
+    __m128i twice = _mm_add_epi16(delta, delta);
+    __m128i from_g = _mm_add_epi16(twice, _mm_sub_epi16(b, r));
+    __m128i from_b = _mm_add_epi16(_mm_add_epi16(twice, twice), _mm_sub_epi16(r, g));
+    __m128i sixths = select_epi16(top_r, _mm_sub_epi16(g, b), select_epi16(top_g, from_g, from_b));
+    __m128i six = _mm_add_epi16(twice, _mm_add_epi16(twice, twice));
+    sixths = _mm_add_epi16(sixths, _mm_and_si128(_mm_srai_epi16(sixths, 15), six));
+
+    __m128i const zero = _mm_setzero_si128(), one = _mm_set1_epi16(1);
+    __m128i hue = hue_ratio_epi16(sixths, 128.f, _mm_max_epi16(delta, one), 3.f);
+    hue = _mm_and_si128(hue, _mm_set1_epi16(255));
+    return _mm_andnot_si128(_mm_cmpeq_epi16(delta, zero), hue);
+}
+
+// R, G, B of eight hues, as hue_to_rgb
+inline void hue_to_rgb_epi16(__m128i hue, __m128i top, __m128i bottom, __m128i rgb[3]) {
+    __m128i const low_byte = _mm_set1_epi16(255), rounding = _mm_set1_epi16(128);
+    __m128i sixths = _mm_mullo_epi16(hue, _mm_set1_epi16(6));
+    __m128i sector = _mm_srli_epi16(sixths, 8), fraction = _mm_and_si128(sixths, low_byte);
+    __m128i span = _mm_sub_epi16(top, bottom);
+    __m128i rising = _mm_add_epi16(bottom, _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(span, fraction), rounding), 8));
+    __m128i rest = _mm_sub_epi16(_mm_set1_epi16(256), fraction);
+    __m128i falling = _mm_add_epi16(bottom, _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(span, rest), rounding), 8));
+
+    __m128i in[6];
+    for (int s = 0; s < 6; ++s)
+        in[s] = _mm_cmpeq_epi16(sector, _mm_set1_epi16(short(s)));
+    rgb[0] = select_epi16(_mm_or_si128(in[0], in[5]), top, select_epi16(in[1], falling, select_epi16(in[4], rising, bottom)));
+    rgb[1] = select_epi16(_mm_or_si128(in[1], in[2]), top, select_epi16(in[0], rising, select_epi16(in[3], falling, bottom)));
+    rgb[2] = select_epi16(_mm_or_si128(in[3], in[4]), top, select_epi16(in[2], rising, select_epi16(in[5], falling, bottom)));
+}
+#endif
+
+// HSV and HSL run eight pixels per step with SSE2 in 16-bit lanes; the
+// divisions are float divides of four lanes, the same ones the scalar
+// tail does, so output does not depend on the path.
+inline void rgb_to_hsv(Image const& src, Image& out) {
+    convert_rows(src, out, [&](png_const_bytep in, png_bytep row, int width) {
+        int x = 0;
+#ifdef PIXEL_OPS_SSE2
+        for (; x + 8 <= width; x += 8) {
+            __m128i planes[4], top, delta;
+            load_planes(in + x * 4, planes);
+            __m128i hue = hue_epi16(planes, top, delta);
+            __m128i saturation = hue_ratio_epi16(delta, 255.f, _mm_max_epi16(top, _mm_set1_epi16(1)), 1.f);
+            store_planes(row + x * 4, hue, saturation, top, planes[3]);
+        }
+#endif
+        for (; x < width; ++x) {
+            png_const_bytep px = in + x * 4;
+            int top = std::max(px[0], std::max(px[1], px[2]));
+            int delta = top - std::min(px[0], std::min(px[1], px[2]));
+            png_byte alpha = px[3];
+
+            row[x * 4 + 0] = png_byte(delta ? hue_byte(px, top, delta) : 0);
+            row[x * 4 + 1] = png_byte(hue_ratio(delta, 255.f, std::max(top, 1), 1.f));
+            row[x * 4 + 2] = png_byte(top);
+            row[x * 4 + 3] = alpha;
+        }
+    });
+}
+
+inline void hsv_to_rgb(Image const& src, Image& out) {
+    convert_rows(src, out, [&](png_const_bytep in, png_bytep row, int width) {
+        int x = 0;
+#ifdef PIXEL_OPS_SSE2
+        for (; x + 8 <= width; x += 8) {
+            __m128i planes[4], rgb[3];
+            load_planes(in + x * 4, planes);
+            __m128i value = planes[2];
+            __m128i scaled = _mm_mullo_epi16(value, _mm_sub_epi16(_mm_set1_epi16(255), planes[1]));
+            __m128i bottom = divide_255_epu16(_mm_add_epi16(scaled, _mm_set1_epi16(127)));
+            hue_to_rgb_epi16(planes[0], value, bottom, rgb);
+            store_planes(row + x * 4, rgb[0], rgb[1], rgb[2], planes[3]);
+        }
+#endif
+        for (; x < width; ++x) {
+            png_const_bytep px = in + x * 4;
+            int hue = px[0], saturation = px[1], value = px[2];
+            png_byte alpha = px[3];
+
+            int bottom = (value * (255 - saturation) + 127) / 255;
+            hue_to_rgb(hue, value, bottom, row + x * 4);
+            row[x * 4 + 3] = alpha;
+        }
+    });
+}
+
+inline void rgb_to_hsl(Image const& src, Image& out) {
+    convert_rows(src, out, [&](png_const_bytep in, png_bytep row, int width) {
+        int x = 0;
+#ifdef PIXEL_OPS_SSE2
+        for (; x + 8 <= width; x += 8) {
+            __m128i planes[4], top, delta;
+            load_planes(in + x * 4, planes);
+            __m128i hue = hue_epi16(planes, top, delta);
+            __m128i sum = _mm_sub_epi16(_mm_add_epi16(top, top), delta);
+            __m128i room = _mm_min_epi16(sum, _mm_sub_epi16(_mm_set1_epi16(510), sum));
+            __m128i saturation = hue_ratio_epi16(delta, 255.f, _mm_max_epi16(room, _mm_set1_epi16(1)), 1.f);
+            __m128i lightness = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(1)), 1);
+            store_planes(row + x * 4, hue, saturation, lightness, planes[3]);
+        }
+#endif
+        for (; x < width; ++x) {
+            png_const_bytep px = in + x * 4;
+            int top = std::max(px[0], std::max(px[1], px[2]));
+            int bottom = std::min(px[0], std::min(px[1], px[2]));
+            int delta = top - bottom, sum = top + bottom;
+            png_byte alpha = px[3];
+
+            // Chroma over the widest chroma this lightness allows, which
+            // is never less than the chroma itself
+            int room = std::min(sum, 510 - sum);
+            row[x * 4 + 0] = png_byte(delta ? hue_byte(px, top, delta) : 0);
+            row[x * 4 + 1] = png_byte(hue_ratio(delta, 255.f, std::max(room, 1), 1.f));
+            row[x * 4 + 2] = png_byte((sum + 1) >> 1);
+            row[x * 4 + 3] = alpha;
+        }
+    });
+}
+
+inline void hsl_to_rgb(Image const& src, Image& out) {
+    convert_rows(src, out, [&](png_const_bytep in, png_bytep row, int width) {
+        int x = 0;
+#ifdef PIXEL_OPS_SSE2
+        for (; x + 8 <= width; x += 8) {
+            __m128i planes[4], rgb[3];
+            load_planes(in + x * 4, planes);
+            __m128i twice = _mm_add_epi16(planes[2], planes[2]);
+            __m128i room = _mm_min_epi16(twice, _mm_sub_epi16(_mm_set1_epi16(510), twice));
+            __m128i chroma = divide_255_epu16(_mm_add_epi16(_mm_mullo_epi16(room, planes[1]), _mm_set1_epi16(127)));
+            __m128i bottom = _mm_max_epi16(_mm_setzero_si128(), _mm_srai_epi16(_mm_add_epi16(_mm_sub_epi16(twice, chroma), _mm_set1_epi16(1)), 1));
+            __m128i top = _mm_min_epi16(_mm_set1_epi16(255), _mm_add_epi16(bottom, chroma));
+            hue_to_rgb_epi16(planes[0], top, bottom, rgb);
+            store_planes(row + x * 4, rgb[0], rgb[1], rgb[2], planes[3]);
+        }
+#endif
+        for (; x < width; ++x) {
+            png_const_bytep px = in + x * 4;
+            int hue = px[0], saturation = px[1], lightness = px[2];
+            png_byte alpha = px[3];
+
+            // top + bottom = 2 L, top - bottom = chroma
+            int room = std::min(2 * lightness, 510 - 2 * lightness);
+            int chroma = (room * saturation + 127) / 255;
+            int bottom = std::max(0, (2 * lightness - chroma + 1) >> 1);
+            int top = std::min(255, bottom + chroma);
+            hue_to_rgb(hue, top, bottom, row + x * 4);
+            row[x * 4 + 3] = alpha;
+        }
+    });
+}
+
+// Byte to linear light, and linear light back to the nearest byte in the
+// sRGB curve. Encoding looks a value up in a uniform table and settles it
+// against the exact rounding thresholds; values outside [0, 1] clamp.
+struct LinearLight {
+    static const int STEPS = 4096;
+    float linear[256];
+    // Linear value where byte v + 1 starts to be nearer than v
+    float threshold[256];
+    png_byte encoded[STEPS + 1];
+
+    png_byte encode(float v) const {
+        v = std::min(std::max(v, 0.f), 1.f);
+        int byte = encoded[int(v * STEPS)];
+        while (byte < 255 && v >= threshold[byte])
+            ++byte;
+        while (byte > 0 && v < threshold[byte - 1])
+            --byte;
+        return png_byte(byte);
+    }
+};
+
+inline LinearLight const& linear_light() {
+    static LinearLight const* const table = [] {
+        static LinearLight built;
+        for (int v = 0; v < 256; ++v) {
+            built.linear[v] = srgb_to_linear(v / 255.f);
+            built.threshold[v] = srgb_to_linear((v + 0.5f) / 255.f);
+        }
+        for (int i = 0; i <= LinearLight::STEPS; ++i)
+            built.encoded[i] = png_byte(std::lround(std::min(linear_to_srgb(float(i) / LinearLight::STEPS), 1.f) * 255.f));
+        return &built;
+    }();
+    return *table;
+}
+
+// Floats are linear R, G, B and alpha, all in [0, 1]
+inline void to_linear(Image const& src, FloatImage& out) {
+    LinearLight const& table = linear_light();
+    if (out.pixels.empty())
+        out.create(src.width, src.height);
+    if (out.width != src.width || out.height != src.height) abort();
+
+    parallel_for(0, src.height, [&](int from, int to) {
+        std::vector<png_byte> scratch(size_t(src.width) * 4);
+        for (int y = from; y < to; ++y) {
+            png_const_bytep in = src.row(y, scratch.data());
+            float* row = out.row(y);
+            for (int x = 0; x < src.width; ++x) {
+                for (int c = 0; c < 3; ++c)
+                    row[x * 4 + c] = table.linear[in[x * 4 + c]];
+                row[x * 4 + 3] = in[x * 4 + 3] * (1.f / 255.f);
+            }
+        }
+    }, 16);
+}
+
+inline void from_linear(FloatImage const& src, Image& out) {
+    LinearLight const& table = linear_light();
+    if (!out.pixels)
+        out.create(src.width, src.height);
+    if (out.width != src.width || out.height != src.height) abort();
+    out.materialize();
+
+    parallel_for(0, src.height, [&](int from, int to) {
+        for (int y = from; y < to; ++y) {
+            float const* in = src.row(y);
+            png_bytep row = out.pixels[y];
+            for (int x = 0; x < src.width; ++x) {
+                for (int c = 0; c < 3; ++c)
+                    row[x * 4 + c] = table.encode(in[x * 4 + c]);
+                row[x * 4 + 3] = png_byte(std::min(std::max(in[x * 4 + 3], 0.f), 1.f) * 255.f + 0.5f);
+            }
+        }
+    }, 16);
+}
+
+// CIE Lab, D65 white. The cube root of Lab's f() is a table over [0, 1]
+// with linear interpolation; XYZ relative to white stays within it for
+// sRGB input and is clamped otherwise.
+struct LabTables {
+    static const int STEPS = 4096;
+    float f[STEPS + 2];
+
+    float lookup(float t) const {
+        t = std::min(std::max(t, 0.f), 1.f) * STEPS;
+        int i = int(t);
+        return f[i] + (f[i + 1] - f[i]) * (t - i);
+    }
+};
+
+inline LabTables const& lab_tables() {
+    static LabTables const* const tables = [] {
+        static LabTables built;
+        for (int i = 0; i <= LabTables::STEPS + 1; ++i) {
+            double t = double(i) / LabTables::STEPS;
+            built.f[i] = float(t > 216.0 / 24389.0 ? std::cbrt(t) : (24389.0 / 27.0 * t + 16.0) / 116.0);
+        }
+        return &built;
+    }();
+    return *tables;
+}
+
+// Linear sRGB to XYZ divided by the D65 white, rows add up to 1
+const float RGB_TO_XYZ[3][3] = {
+    { 0.4124564f / 0.95047f, 0.3575761f / 0.95047f, 0.1804375f / 0.95047f },
+    { 0.2126729f, 0.7151522f, 0.0721750f },
+    { 0.0193339f / 1.08883f, 0.1191920f / 1.08883f, 0.9503041f / 1.08883f },
+};
+
+// Inverse of the above
+const float XYZ_TO_RGB[3][3] = {
+    { 3.2404542f * 0.95047f, -1.5371385f, -0.4985314f * 1.08883f },
+    { -0.9692660f * 0.95047f, 1.8760108f, 0.0415560f * 1.08883f },
+    { 0.0556434f * 0.95047f, -0.2040259f, 1.0572252f * 1.08883f },
+};
+
+// Floats are L in [0, 100], a, b, and alpha in [0, 1]
+inline void rgb_to_lab(Image const& src, FloatImage& out) {
+    LinearLight const& light = linear_light();
+    LabTables const& tables = lab_tables();
+    if (out.pixels.empty())
+        out.create(src.width, src.height);
+    if (out.width != src.width || out.height != src.height) abort();
+
+    parallel_for(0, src.height, [&](int from, int to) {
+        std::vector<png_byte> scratch(size_t(src.width) * 4);
+        for (int y = from; y < to; ++y) {
+            png_const_bytep in = src.row(y, scratch.data());
+            float* row = out.row(y);
+            for (int x = 0; x < src.width; ++x) {
+                float rgb[3], f[3];
+                for (int c = 0; c < 3; ++c)
+                    rgb[c] = light.linear[in[x * 4 + c]];
+                for (int i = 0; i < 3; ++i)
+                    f[i] = tables.lookup(RGB_TO_XYZ[i][0] * rgb[0] + RGB_TO_XYZ[i][1] * rgb[1] + RGB_TO_XYZ[i][2] * rgb[2]);
+
+                row[x * 4 + 0] = 116.f * f[1] - 16.f;
+                row[x * 4 + 1] = 500.f * (f[0] - f[1]);
+                row[x * 4 + 2] = 200.f * (f[1] - f[2]);
+                row[x * 4 + 3] = in[x * 4 + 3] * (1.f / 255.f);
+            }
+        }
+    }, 16);
+}
+
+inline void lab_to_rgb(FloatImage const& src, Image& out) {
+    LinearLight const& light = linear_light();
+    if (!out.pixels)
+        out.create(src.width, src.height);
+    if (out.width != src.width || out.height != src.height) abort();
+    out.materialize();
+
+    // Inverse of f(), cubic above the knee
+    auto cube = [](float f) {
+        return f > 6.f / 29.f ? f * f * f : 3.f * (6.f / 29.f) * (6.f / 29.f) * (f - 4.f / 29.f);
+    };
+
+    parallel_for(0, src.height, [&](int from, int to) {
+        for (int y = from; y < to; ++y) {
+            float const* in = src.row(y);
+            png_bytep row = out.pixels[y];
+            for (int x = 0; x < src.width; ++x) {
+                float fy = (in[x * 4] + 16.f) / 116.f;
+                float xyz[3] = { cube(fy + in[x * 4 + 1] / 500.f), cube(fy), cube(fy - in[x * 4 + 2] / 200.f) };
+                for (int c = 0; c < 3; ++c)
+                    row[x * 4 + c] = light.encode(XYZ_TO_RGB[c][0] * xyz[0] + XYZ_TO_RGB[c][1] * xyz[1] + XYZ_TO_RGB[c][2] * xyz[2]);
+                row[x * 4 + 3] = png_byte(std::min(std::max(in[x * 4 + 3], 0.f), 1.f) * 255.f + 0.5f);
+            }
+        }
+    }, 16);
+}
@@ -0,0 +1,448 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <type_traits>
+#include "png_files.h"
+#include "parallel.h"
+
+// 2D convolution of RGBA images with small integer kernels, described the
+// same way as lab2's Filter: a matrix of ints, rows top to bottom. The
+// anchor (the pixel being computed) is given by position instead of F_P,
+// as every cell of a convolution kernel carries a weight.
+//
+//     out = clamp(sum(weight * pixel) / divisor + bias)
+//
+// Sums are exact integers, normalized by one float multiply, so the
+// separable and the direct path give identical results. Edges are
+// extended by repeating the border pixels.
+
+struct ConvolutionKernel {
+    int width = 0, height = 0;
+    int anchor_x = 0, anchor_y = 0;
+    // Row-major, width * height
+    std::vector<int> weights;
+    int divisor = 1, bias = 0;
+
+    // Sums are normalized as float(sum) * inverse, rounded
+    float inverse = 1.f;
+
+    // Rank one kernels: weights[y * width + x] == column[y] * row[x]
+    bool separable = false;
+    std::vector<int> row, column;
+
+    // Anchor in the middle
+    ConvolutionKernel(std::vector<std::vector<int>> const& data)
+        : ConvolutionKernel(data, int(data[0].size()) / 2, int(data.size()) / 2) {}
+
+    // A divisor of 0 means the sum of the weights (1 if that is 0)
+    ConvolutionKernel(
+        std::vector<std::vector<int>> const& data,
+        int _anchor_x, int _anchor_y,
+        int _divisor = 0, int _bias = 0
+    ) : width(int(data[0].size())), height(int(data.size())),
+        anchor_x(_anchor_x), anchor_y(_anchor_y), bias(_bias) {
+        if (anchor_x < 0 || anchor_x >= width || anchor_y < 0 || anchor_y >= height) abort();
+
+        int sum = 0;
+        int64_t magnitude = 0;
+        for (auto const& line : data) {
+            if (int(line.size()) != width) abort();
+            for (int w : line) {
+                weights.push_back(w);
+                sum += w;
+                magnitude += std::abs(w);
+            }
+        }
+
+        divisor = _divisor ? _divisor : (sum ? sum : 1);
+
+        // Largest sums have to fit into an int
+        if (255 * magnitude >= (int64_t(1) << 31)) abort();
+        inverse = 1.f / divisor;
+
+        _factorize();
+    }
+
+    // Exact integer factorization: the first non-zero row divided by the
+    // gcd of its weights, every other row has to be a multiple of it
+    void _factorize() {
+        int first = -1;
+        for (int y = 0; y < height && first < 0; ++y)
+            for (int x = 0; x < width; ++x)
+                if (weights[y * width + x]) first = y;
+        if (first < 0 || width == 1 || height == 1)
+            return;
+
+        auto gcd = [](int a, int b) {
+            a = std::abs(a), b = std::abs(b);
+            while (b) {
+                int r = a % b;
+                a = b, b = r;
+            }
+            return a;
+        };
+
+        int divide = 0, lead = -1;
+        for (int x = 0; x < width; ++x) {
+            divide = gcd(divide, weights[first * width + x]);
+            if (lead < 0 && weights[first * width + x]) lead = x;
+        }
+        if (weights[first * width + lead] < 0)
+            divide = -divide;
+
+        std::vector<int> _row(width), _column(height);
+        for (int x = 0; x < width; ++x)
+            _row[x] = weights[first * width + x] / divide;
+
+        for (int y = 0; y < height; ++y) {
+            int w = weights[y * width + lead];
+            if (w % _row[lead]) return;
+            _column[y] = w / _row[lead];
+            for (int x = 0; x < width; ++x)
+                if (weights[y * width + x] != _column[y] * _row[x]) return;
+        }
+
+        separable = true;
+        row = _row;
+        column = _column;
+    }
+};
+
+// Common kernels
+
+inline ConvolutionKernel box_kernel(int radius) {
+    return ConvolutionKernel(std::vector<std::vector<int>>(radius * 2 + 1, std::vector<int>(radius * 2 + 1, 1)));
+}
+
+// Binomial approximation of a Gaussian, (2 * radius + 1) taps
+inline ConvolutionKernel binomial_kernel(int radius) {
+    std::vector<int> line = { 1 };
+    for (int i = 0; i < radius * 2; ++i) {
+        std::vector<int> next(line.size() + 1, 0);
+        for (size_t k = 0; k < line.size(); ++k)
+            next[k] += line[k], next[k + 1] += line[k];
+        line = next;
+    }
+
+    std::vector<std::vector<int>> data(line.size(), std::vector<int>(line.size()));
+    for (size_t y = 0; y < line.size(); ++y)
+        for (size_t x = 0; x < line.size(); ++x)
+            data[y][x] = line[y] * line[x];
+    return ConvolutionKernel(data);
+}
+
+inline ConvolutionKernel sharpen_kernel() {
+    return ConvolutionKernel({
+        { 0, -1,  0},
+        {-1,  5, -1},
+        { 0, -1,  0},
+    });
+}
+
+inline ConvolutionKernel emboss_kernel() {
+    return ConvolutionKernel({
+        {-2, -1, 0},
+        {-1,  1, 1},
+        { 0,  1, 2},
+    }, 1, 1, 1, 128);
+}
+
+inline ConvolutionKernel edge_kernel() {
+    return ConvolutionKernel({
+        {-1, -1, -1},
+        {-1,  8, -1},
+        {-1, -1, -1},
+    });
+}
+
+// Source rows with the edge pixels repeated pad_left / pad_right times on
+// each side, kept for the rows the current output row needs. Slots are
+// picked by source row modulo the ring size: the rows in use always form
+// a contiguous range no longer than the ring.
+class PaddedRows {
+private:
+    Image const& m_src;
+    int m_pad_left, m_pad_right;
+    size_t m_stride;
+    std::vector<png_byte> m_data;
+    std::vector<int> m_rows;
+public:
+    PaddedRows(Image const& _src, int _count, int _pad_left, int _pad_right)
+        : m_src(_src), m_pad_left(_pad_left), m_pad_right(_pad_right),
+          m_stride(size_t(_src.width + _pad_left + _pad_right) * 4),
+          m_data(m_stride * _count), m_rows(_count, -1) {}
+
+    // Padded row y (clamped to the image), pointing at pixel 0
+    png_const_bytep get(int y) {
+        y = std::max(0, std::min(y, m_src.height - 1));
+        int slot = y % int(m_rows.size());
+        png_bytep row = &m_data[slot * m_stride];
+
+        if (m_rows[slot] != y) {
+            m_rows[slot] = y;
+            png_const_bytep src_row = m_src.row(y, row + m_pad_left * 4);
+            if (src_row != row + m_pad_left * 4)
+                memcpy(row + m_pad_left * 4, src_row, size_t(m_src.width) * 4);
+
+            uint32_t* px = (uint32_t*)row;
+            uint32_t first = px[m_pad_left], last = px[m_pad_left + m_src.width - 1];
+            std::fill(px, px + m_pad_left, first);
+            std::fill(px + m_pad_left + m_src.width, px + m_pad_left + m_src.width + m_pad_right, last);
+        }
+        return row + m_pad_left * 4;
+    }
+};
+
+// Normalization of a chunk of sums into bytes, four pixels at a time with
+// SSE2. Both paths do the same float ops, so they round the same way.
+// Keeps the source alpha when only 3 channels are convolved.
+inline void store_sums(
+    png_bytep row_out,
+    int const* sums,
+    png_const_bytep row_src,
+    int n,
+    ConvolutionKernel const& kernel,
+    int channels
+) {
+    float const inverse = kernel.inverse, offset = kernel.bias + 0.5f;
+    int i = 0;
+
+#ifdef PIXEL_OPS_SSE2
+    __m128 v_inverse = _mm_set1_ps(inverse), v_offset = _mm_set1_ps(offset);
+    __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps(255.f);
+    auto normalize = [&](int k) {
+        __m128 v = _mm_cvtepi32_ps(_mm_loadu_si128((__m128i const*)(sums + i + k * 4)));
+        v = _mm_add_ps(_mm_mul_ps(v, v_inverse), v_offset);
+        return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(v, lo), hi));
+    };
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i low = _mm_packs_epi32(normalize(0), normalize(1));
+        __m128i high = _mm_packs_epi32(normalize(2), normalize(3));
+        _mm_storeu_si128((__m128i*)(row_out + i), _mm_packus_epi16(low, high));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        float v = float(sums[i]) * inverse + offset;
+        v = v < 0.f ? 0.f : v;
+        row_out[i] = png_byte(int(v > 255.f ? 255.f : v));
+    }
+
+    if (channels == 3)
+        for (i = 3; i < n; i += 4)
+            row_out[i] = row_src[i];
+}
+
+// One weighted input row of a sum
+template<typename T>
+struct Tap {
+    T const* row;
+    int weight;
+};
+
+// Two taps at once over [i, n): with SSE2 their values are interleaved as
+// 16-bit pairs, so a single pmaddwd multiplies and adds both. Weights and
+// values have to fit into 16 bits. Returns where the scalar tail starts.
+#ifdef PIXEL_OPS_SSE2
+inline int sum_pair_sse2(int* sums, png_const_bytep a, png_const_bytep b, int weights, int n, bool first) {
+    int i = 0;
+    __m128i zero = _mm_setzero_si128();
+    __m128i w = _mm_set1_epi32(weights);
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((__m128i const*)(a + i));
+        __m128i vb = _mm_loadu_si128((__m128i const*)(b + i));
+        __m128i a_lo = _mm_unpacklo_epi8(va, zero), a_hi = _mm_unpackhi_epi8(va, zero);
+        __m128i b_lo = _mm_unpacklo_epi8(vb, zero), b_hi = _mm_unpackhi_epi8(vb, zero);
+
+        __m128i s[4] = {
+            _mm_madd_epi16(_mm_unpacklo_epi16(a_lo, b_lo), w),
+            _mm_madd_epi16(_mm_unpackhi_epi16(a_lo, b_lo), w),
+            _mm_madd_epi16(_mm_unpacklo_epi16(a_hi, b_hi), w),
+            _mm_madd_epi16(_mm_unpackhi_epi16(a_hi, b_hi), w),
+        };
+        for (int k = 0; k < 4; ++k) {
+            __m128i* out = (__m128i*)(sums + i + k * 4);
+            _mm_storeu_si128(out, first ? s[k] : _mm_add_epi32(_mm_loadu_si128(out), s[k]));
+        }
+    }
+    return i;
+}
+
+inline int sum_pair_sse2(int* sums, int16_t const* a, int16_t const* b, int weights, int n, bool first) {
+    int i = 0;
+    __m128i w = _mm_set1_epi32(weights);
+    for (; i + 8 <= n; i += 8) {
+        __m128i va = _mm_loadu_si128((__m128i const*)(a + i));
+        __m128i vb = _mm_loadu_si128((__m128i const*)(b + i));
+
+        __m128i s[2] = {
+            _mm_madd_epi16(_mm_unpacklo_epi16(va, vb), w),
+            _mm_madd_epi16(_mm_unpackhi_epi16(va, vb), w),
+        };
+        for (int k = 0; k < 2; ++k) {
+            __m128i* out = (__m128i*)(sums + i + k * 4);
+            _mm_storeu_si128(out, first ? s[k] : _mm_add_epi32(_mm_loadu_si128(out), s[k]));
+        }
+    }
+    return i;
+}
+#endif
+
+// Wide values, and every type without SSE2, have no SIMD path
+template<typename T>
+inline int sum_pair_sse2(int*, T const*, T const*, int, int, bool) {
+    return 0;
+}
+
+// sums[i] = sum of weight * row[offset + i] over all taps, for i < n
+template<typename T>
+void sum_taps(int* sums, Tap<T> const* taps, int count, int offset, int n, bool simd) {
+    if (!count) {
+        std::fill(sums, sums + n, 0);
+        return;
+    }
+
+    for (int t = 0; t < count; t += 2) {
+        // An odd tap out is paired with itself at weight 0
+        Tap<T> a = taps[t], b = t + 1 < count ? taps[t + 1] : Tap<T>{ taps[t].row, 0 };
+        T const* row_a = a.row + offset;
+        T const* row_b = b.row + offset;
+        bool first = t == 0;
+
+        int i = simd ? sum_pair_sse2(sums, row_a, row_b, (b.weight << 16) | (a.weight & 0xFFFF), n, first) : 0;
+        if (first)
+            for (; i < n; ++i)
+                sums[i] = a.weight * row_a[i] + b.weight * row_b[i];
+        else
+            for (; i < n; ++i)
+                sums[i] += a.weight * row_a[i] + b.weight * row_b[i];
+    }
+}
+
+// Values per chunk of a row: the sums of a chunk stay in L1 while every
+// tap is added to them
+const int CONVOLUTION_CHUNK = 1024;
+
+inline bool fits_int16(int64_t value) {
+    return value >= -32768 && value <= 32767;
+}
+
+// Separable pass pair with horizontal sums of type H kept in a ring of
+// rows, same slots as PaddedRows
+template<typename H>
+void convolve_separable(Image const& src, Image& out, ConvolutionKernel const& kernel, int channels, int from, int to) {
+    int const n = src.width * 4;
+    int const pad_left = kernel.anchor_x;
+    PaddedRows rows(src, kernel.height, pad_left, kernel.width - 1 - pad_left);
+
+    bool simd_row = true, simd_column = !std::is_same<H, int>::value;
+    for (int w : kernel.row) simd_row &= fits_int16(w);
+    for (int w : kernel.column) simd_column &= fits_int16(w);
+
+    std::vector<H> horizontal(size_t(kernel.height) * n);
+    std::vector<int> ring_rows(kernel.height, -1);
+    std::vector<int> sums(CONVOLUTION_CHUNK);
+    std::vector<Tap<png_byte>> row_taps;
+    std::vector<Tap<H>> column_taps;
+
+    auto horizontal_row = [&](int y) -> H const* {
+        y = std::max(0, std::min(y, src.height - 1));
+        int slot = y % kernel.height;
+        H* h = &horizontal[size_t(slot) * n];
+
+        if (ring_rows[slot] != y) {
+            ring_rows[slot] = y;
+            png_const_bytep p = rows.get(y);
+
+            row_taps.clear();
+            for (int k = 0; k < kernel.width; ++k)
+                if (kernel.row[k])
+                    row_taps.push_back({ p + (k - pad_left) * 4, kernel.row[k] });
+
+            for (int c = 0; c < n; c += CONVOLUTION_CHUNK) {
+                int len = std::min(CONVOLUTION_CHUNK, n - c);
+                sum_taps(sums.data(), row_taps.data(), int(row_taps.size()), c, len, simd_row);
+                std::copy(sums.begin(), sums.begin() + len, h + c);
+            }
+        }
+        return h;
+    };
+
+    for (int y = from; y < to; ++y) {
+        column_taps.clear();
+        for (int k = 0; k < kernel.height; ++k)
+            if (kernel.column[k])
+                column_taps.push_back({ horizontal_row(y + k - kernel.anchor_y), kernel.column[k] });
+
+        png_const_bytep row_src = rows.get(y);
+        for (int c = 0; c < n; c += CONVOLUTION_CHUNK) {
+            int len = std::min(CONVOLUTION_CHUNK, n - c);
+            sum_taps(sums.data(), column_taps.data(), int(column_taps.size()), c, len, simd_column);
+            store_sums(out.pixels[y] + c, sums.data(), row_src + c, len, kernel, channels);
+        }
+    }
+}
+
+// Convolve src into out (channels = 3 keeps the alpha of src). Rows are
+// split across threads and processed in chunks that stay in L1, with SSE2
+// for 16-bit weights. Separable kernels run as a horizontal pass into a
+// ring of rows and a vertical pass over it, width + height multiplies per
+// pixel instead of width * height; the ring holds 16-bit values whenever
+// the horizontal sums fit. Borders are handled once per row when it is
+// padded, so the pixel loops have no edge checks.
+inline void convolve(
+    Image const& src,
+    Image& out,
+    ConvolutionKernel const& kernel,
+    int channels = 4
+) {
+    if (&src == &out) abort();
+    if (!out.pixels)
+        src.same(out);
+    if (out.width != src.width || out.height != src.height) abort();
+    out.materialize();
+
+    int64_t row_magnitude = 0;
+    for (int w : kernel.row)
+        row_magnitude += std::abs(w);
+
+    parallel_for(0, src.height, [&](int from, int to) {
+        if (kernel.separable) {
+            if (fits_int16(255 * row_magnitude))
+                convolve_separable<int16_t>(src, out, kernel, channels, from, to);
+            else
+                convolve_separable<int>(src, out, kernel, channels, from, to);
+            return;
+        }
+
+        int const n = src.width * 4;
+        int const pad_left = kernel.anchor_x;
+        PaddedRows rows(src, kernel.height, pad_left, kernel.width - 1 - pad_left);
+        std::vector<int> sums(CONVOLUTION_CHUNK);
+        std::vector<Tap<png_byte>> taps;
+
+        bool simd = true;
+        for (int w : kernel.weights) simd &= fits_int16(w);
+
+        for (int y = from; y < to; ++y) {
+            taps.clear();
+            for (int ky = 0; ky < kernel.height; ++ky) {
+                png_const_bytep p = rows.get(y + ky - kernel.anchor_y);
+                for (int kx = 0; kx < kernel.width; ++kx) {
+                    int w = kernel.weights[ky * kernel.width + kx];
+                    if (w)
+                        taps.push_back({ p + (kx - pad_left) * 4, w });
+                }
+            }
+
+            png_const_bytep row_src = rows.get(y);
+            for (int c = 0; c < n; c += CONVOLUTION_CHUNK) {
+                int len = std::min(CONVOLUTION_CHUNK, n - c);
+                sum_taps(sums.data(), taps.data(), int(taps.size()), c, len, simd);
+                store_sums(out.pixels[y] + c, sums.data(), row_src + c, len, kernel, channels);
+            }
+        }
+    }, 16);
+}
@@ -0,0 +1,1128 @@
+#pragma once
+#include "png_files.h"
+#include "palette.h"
+#include "colorspace.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <type_traits>
+#include <stdint.h>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#define F_P -1
+
+#define RGB 3
+#define RGBA 4
+
+// Fixed-point precision of compiled kernel weights. A share is exactly
+// err * w / divisor truncated toward zero for |err| < 2^24 / divisor.
+const int WEIGHT_SHIFT = 24;
+
+// Limits of the runtime kernel path
+const int MAX_TAPS = 32;
+const int MAX_KERNEL_ROWS = 8;
+
+constexpr int64_t fixed_weight(int weight, int divisor) {
+    return ((int64_t(weight) << WEIGHT_SHIFT) + divisor - 1) / divisor;
+}
+
+// err * w / divisor rounded toward zero, without a division or a branch
+inline int error_share(int err, int64_t weight) {
+    int sign = err >> 31;
+    int magnitude = (err ^ sign) - sign;
+    int share = int((magnitude * weight) >> WEIGHT_SHIFT);
+    return (share ^ sign) - sign;
+}
+
+inline png_byte clamp_byte(int value) {
+    value = value < 0 ? 0 : value;
+    return png_byte(value > 255 ? 255 : value);
+}
+
+enum ScanOrder {
+    RASTER,
+    SERPENTINE,
+};
+
+// One weight of an error diffusion kernel, relative to the current pixel.
+// Taps must come after the pixel in raster order (dy > 0, or dy == 0, dx > 0).
+struct KernelTap {
+    int dx, dy, weight;
+};
+
+// Taps of a kernel known only at runtime (see Filter)
+struct RuntimeTaps {
+    int count = 0;
+    int dx[MAX_TAPS];
+    int dy[MAX_TAPS];
+    int64_t weight[MAX_TAPS];
+    int min_dx = 0, max_dx = 0;
+    int max_dy = 0;
+
+    template<typename Func>
+    void for_each(Func&& func) const {
+        for (int t = 0; t < count; ++t)
+            func(dx[t], dy[t], weight[t]);
+    }
+};
+
+template<typename Kernel>
+constexpr int kernel_bound(int KernelTap::* field, bool is_max) {
+    int bound = 0;
+    for (KernelTap const& tap : Kernel::taps)
+        bound = is_max ? std::max(bound, tap.*field) : std::min(bound, tap.*field);
+    return bound;
+}
+
+// Taps of a compile-time kernel: a struct with
+//     static constexpr int divisor;
+//     static constexpr KernelTap taps[];
+// for_each is expanded into straight-line code with constant offsets and
+// weights, one block per tap.
+template<typename Kernel>
+struct StaticTaps {
+    static constexpr int count = int(sizeof(Kernel::taps) / sizeof(KernelTap));
+    static constexpr int min_dx = kernel_bound<Kernel>(&KernelTap::dx, false);
+    static constexpr int max_dx = kernel_bound<Kernel>(&KernelTap::dx, true);
+    static constexpr int max_dy = kernel_bound<Kernel>(&KernelTap::dy, true);
+
+    template<typename Func, size_t... I>
+    static void _for_each(Func&& func, std::index_sequence<I...>) {
+        (func(
+            std::integral_constant<int, Kernel::taps[I].dx>(),
+            std::integral_constant<int, Kernel::taps[I].dy>(),
+            std::integral_constant<int64_t, fixed_weight(Kernel::taps[I].weight, Kernel::divisor)>()
+        ), ...);
+    }
+
+    template<typename Func>
+    void for_each(Func&& func) const {
+        _for_each(func, std::make_index_sequence<count>());
+    }
+};
+
+// Quantization of a byte to 1 << n uniform levels
+inline void uniform_levels(int n, png_byte levels[256]) {
+    int colors = 1 << n;
+    for (int v = 0; v < 256; ++v)
+        levels[v] = png_byte(int(std::round(v / 255.f * (colors - 1)) * (255.f / float(colors - 1))));
+}
+
+// Error adjusted values a quantizer can see. Every quantization error is
+// at most 128 in magnitude and kernels spread at most all of it (shares
+// are truncated toward zero, weights are non-negative and divided by their
+// sum), so a value never leaves [-128, 383]; the tables keep a margin on
+// top of that.
+const int LEVEL_BIAS = 256;
+const int LEVEL_RANGE = 256 + 2 * LEVEL_BIAS;
+
+// Quantization to 1 << n uniform levels precomputed over the whole error
+// adjusted range: no clamping or float math per pixel
+struct LevelTable {
+    // Output byte of value, at [value + LEVEL_BIAS]
+    png_byte quantized[LEVEL_RANGE];
+    // Output byte of level index 0 .. (1 << n) - 1
+    png_byte level[256];
+
+    png_byte const* lookup() const {
+        return quantized + LEVEL_BIAS;
+    }
+};
+
+// Table for bit depth n (1..8), built once and shared
+inline LevelTable const& level_table(int n) {
+    static LevelTable const* const tables = [] {
+        static LevelTable built[8];
+        for (int depth = 1; depth <= 8; ++depth) {
+            LevelTable& table = built[depth - 1];
+            png_byte levels[256];
+            uniform_levels(depth, levels);
+
+            for (int v = -LEVEL_BIAS; v < 256 + LEVEL_BIAS; ++v)
+                table.quantized[v + LEVEL_BIAS] = levels[clamp_byte(v)];
+
+            int colors = 1 << depth;
+            for (int i = 0; i < 256; ++i)
+                table.level[i] = png_byte(int(float(std::min(i, colors - 1)) * (255.f / float(colors - 1))));
+        }
+        return built;
+    }();
+
+    if (n < 1 || n > 8) abort();
+    return tables[n - 1];
+}
+
+// Linear light in 12 bit fixed point, for diffusing error in a space where
+// averaging pixels matches how they mix on screen
+const int LINEAR_MAX = 4095;
+// Quantization errors in linear light stay within half the widest gap
+// between two levels (2048 for n = 1), values within [-2048, 6143]
+const int LINEAR_BIAS = 4096;
+const int LINEAR_RANGE = LINEAR_MAX + 1 + 2 * LINEAR_BIAS;
+
+// Output byte of the level nearest to each linear value, for every depth
+struct LinearTables {
+    uint16_t linear[256];
+    png_byte quantized[8][LINEAR_RANGE];
+
+    png_byte const* lookup(int n) const {
+        return quantized[n - 1] + LINEAR_BIAS;
+    }
+};
+
+inline LinearTables const& linear_tables() {
+    static LinearTables const* const tables = [] {
+        static LinearTables built;
+        for (int v = 0; v < 256; ++v)
+            built.linear[v] = uint16_t(std::lround(srgb_to_linear(v / 255.f) * LINEAR_MAX));
+
+        // Levels are increasing in linear light too, walk them alongside v
+        for (int n = 1; n <= 8; ++n) {
+            png_byte const* levels = level_table(n).level;
+            int colors = 1 << n;
+            int k = 0;
+            for (int v = -LINEAR_BIAS; v <= LINEAR_MAX + LINEAR_BIAS; ++v) {
+                while (k + 1 < colors && std::abs(built.linear[levels[k + 1]] - v) < std::abs(built.linear[levels[k]] - v))
+                    ++k;
+                built.quantized[n - 1][v + LINEAR_BIAS] = levels[k];
+            }
+        }
+        return &built;
+    }();
+    return *tables;
+}
+
+// Quantizers map an error adjusted pixel to its output colour, working in
+// their own value space: load(byte) converts a source byte into it and
+// value_of(byte) gives the value an output byte stands for, the error
+// being the difference. Per channel ones provide channel(int value), the
+// others operator()(int value[4], png_byte out[4], int channels) filling
+// the first channels bytes of out. Those clamp value to the source range
+// in place, so the clipped part is not diffused: a palette need not span
+// that range, and the error toward a colour it cannot reach would
+// otherwise keep growing along the row.
+
+// 1 << n uniform levels per channel
+struct UniformQuantizer {
+    png_byte const* lookup;
+
+    UniformQuantizer(int n) : lookup(level_table(n).lookup()) {}
+
+    static constexpr bool per_channel = true;
+
+    int load(png_byte v) const { return v; }
+    int value_of(png_byte v) const { return v; }
+
+    png_byte channel(int value) const {
+        return lookup[value];
+    }
+};
+
+// Uniform levels chosen and diffused in linear light, RGB only
+struct LinearQuantizer {
+    uint16_t const* linear;
+    png_byte const* lookup;
+
+    LinearQuantizer(int n) : linear(linear_tables().linear), lookup(linear_tables().lookup(n)) {}
+
+    static constexpr bool per_channel = true;
+
+    int load(png_byte v) const { return linear[v]; }
+    int value_of(png_byte v) const { return linear[v]; }
+
+    png_byte channel(int value) const {
+        return lookup[value];
+    }
+};
+
+// Nearest colour of a palette, RGB only
+struct PaletteQuantizer {
+    Palette const* palette;
+
+    PaletteQuantizer(Palette const& _palette) : palette(&_palette) {}
+
+    static constexpr bool per_channel = false;
+
+    int load(png_byte v) const { return v; }
+    int value_of(png_byte v) const { return v; }
+
+    void operator()(int* value, png_byte* out, int) const {
+        for (int i = 0; i < 3; ++i)
+            value[i] = clamp_byte(value[i]);
+
+        png_color const& c = (*palette)[palette->nearest(value[0], value[1], value[2])];
+        out[0] = c.red;
+        out[1] = c.green;
+        out[2] = c.blue;
+    }
+};
+
+// Palette colours chosen and diffused in linear light. search holds the
+// palette converted to 8 bit linear light, in the same order, so the
+// nearest colour is still found through its lookup grid.
+struct LinearPaletteQuantizer {
+    Palette const* palette;
+    Palette const* search;
+    uint16_t const* linear;
+
+    LinearPaletteQuantizer(Palette const& _palette, Palette const& _search)
+        : palette(&_palette), search(&_search), linear(linear_tables().linear) {}
+
+    static Palette search_palette(Palette const& palette) {
+        uint16_t const* linear = linear_tables().linear;
+        auto to_byte = [&](png_byte v) { return png_byte((linear[v] * 255 + LINEAR_MAX / 2) / LINEAR_MAX); };
+
+        std::vector<png_color> colors = palette.colors();
+        for (png_color& c : colors)
+            c.red = to_byte(c.red), c.green = to_byte(c.green), c.blue = to_byte(c.blue);
+        return Palette(colors);
+    }
+
+    static constexpr bool per_channel = false;
+
+    int load(png_byte v) const { return linear[v]; }
+    int value_of(png_byte v) const { return linear[v]; }
+
+    void operator()(int* value, png_byte* out, int) const {
+        int v[3];
+        for (int i = 0; i < 3; ++i) {
+            value[i] = std::max(0, std::min(value[i], LINEAR_MAX));
+            v[i] = (value[i] * 255 + LINEAR_MAX / 2) / LINEAR_MAX;
+        }
+
+        png_color const& c = (*palette)[search->nearest(v[0], v[1], v[2])];
+        out[0] = c.red;
+        out[1] = c.green;
+        out[2] = c.blue;
+    }
+};
+
+// Dither one row. err_rows[dy] is the error accumulated so far for row
+// y + dy, 4 ints per pixel and padded so that every tap lands inside it;
+// the row needs no bounds checks at all. Taps and row pointers are copied
+// to locals first: stores through png_bytep may alias anything else, which
+// would force the compiler to reload them for every channel.
+//
+// Reverse scans the row right to left with the kernel mirrored, resolved at
+// compile time so the pixel loop has no direction checks.
+template<bool Reverse, typename Quantizer, typename Taps>
+void diffuse_row(
+    png_const_bytep row_src,
+    png_bytep row_out,
+    int* const* _err_rows,
+    int from, int to,
+    Quantizer const& _quantizer,
+    int channels,
+    Taps const& _taps
+) {
+    Taps const taps = _taps;
+    Quantizer const quantizer = _quantizer;
+
+    int* err_rows[MAX_KERNEL_ROWS];
+    for (int dy = 0; dy <= taps.max_dy; ++dy)
+        err_rows[dy] = _err_rows[dy];
+    int const* err_row = err_rows[0];
+
+    for (int k = from; k < to; ++k) {
+        int x = Reverse ? from + to - 1 - k : k;
+        png_const_bytep px_src = &(row_src[x * 4]);
+        png_bytep px_out = &(row_out[x * 4]);
+
+        int value[4];
+        png_byte new_px[4];
+        if constexpr (Quantizer::per_channel) {
+            for (int i = 0; i < channels; ++i) {
+                value[i] = quantizer.load(px_src[i]) + err_row[x * 4 + i];
+                new_px[i] = quantizer.channel(value[i]);
+            }
+        } else {
+            for (int i = 0; i < channels; ++i)
+                value[i] = quantizer.load(px_src[i]) + err_row[x * 4 + i];
+            quantizer(value, new_px, channels);
+        }
+
+        int err_px[4];
+        int any_err = 0;
+        for (int i = 0; i < channels; ++i) {
+            err_px[i] = value[i] - quantizer.value_of(new_px[i]);
+            any_err |= err_px[i];
+            px_out[i] = new_px[i];
+        }
+        for (int i = channels; i < 4; ++i)
+            px_out[i] = px_src[i];
+
+        // Exact levels (always the case for n = 8) have nothing to spread
+        if (!any_err)
+            continue;
+
+        taps.for_each([&](auto dx, auto dy, auto weight) {
+            int* err = err_rows[dy] + (Reverse ? x - dx : x + dx) * 4;
+            for (int i = 0; i < channels; ++i)
+                err[i] += error_share(err_px[i], weight);
+        });
+    }
+}
+
+// Error diffusion in raster order. The error is kept at full precision in a
+// ring of int rows instead of being written back into the image: src is
+// only read, every output pixel is written once and rows are consumed top
+// to bottom. src and out may be the same image.
+//
+// With several threads (0 = one per core) rows are dealt out round robin
+// and each row trails the one above it by the kernel's reach (a wavefront).
+// Error is only ever added as integers, so the result is identical to the
+// sequential scan whatever the interleaving.
+//
+// SERPENTINE scans odd rows right to left with the kernel mirrored. A row
+// then depends on the far end of the row above, so it always runs on one
+// thread.
+template<typename Quantizer, typename Taps>
+void diffuse(
+    Image const& src,
+    Image& out,
+    Quantizer const& quantizer,
+    int channels,
+    Taps const& taps,
+    int threads = 1,
+    ScanOrder scan = RASTER
+) {
+    if (!out.pixels)
+        src.same(out);
+    if (out.width != src.width || out.height != src.height) abort();
+    // Rows are written as stored; in place this applies src's orientation
+    // first, after which src reads the same stored rows
+    out.materialize();
+
+    if (threads <= 0)
+        threads = int(std::thread::hardware_concurrency());
+    threads = std::max(1, std::min(threads, src.height));
+    if (scan == SERPENTINE)
+        threads = 1;
+
+    // Rows in flight plus the rows they spread error into. Mirrored rows
+    // reach as far right as normal rows reach left and vice versa.
+    int ring = threads + taps.max_dy;
+    int reach = std::max(-taps.min_dx, taps.max_dx);
+    int pad_left = scan == SERPENTINE ? reach : -taps.min_dx;
+    int pad_right = scan == SERPENTINE ? reach : taps.max_dx;
+    size_t stride = size_t(src.width + pad_left + pad_right) * 4;
+    std::vector<int> errors(ring * stride, 0);
+
+    // How far row y - 1 has to be ahead of row y: far enough that all
+    // error for the current pixel has arrived. When both rows add into one
+    // error row (taps with dy = 0, or kernels reaching two rows down) also
+    // far enough that they never add to the same pixel at once.
+    bool same_row = false;
+    taps.for_each([&](auto, auto dy, auto) {
+        if (dy == 0)
+            same_row = true;
+    });
+    int lag = 1 - taps.min_dx;
+    if (same_row || taps.max_dy >= 2)
+        lag = std::max(lag, taps.max_dx - taps.min_dx + 1);
+
+    // Pixels finished per row, published once per chunk
+    const int CHUNK = 64;
+    std::unique_ptr<std::atomic<int>[]> done(new std::atomic<int>[src.height]);
+    for (int y = 0; y < src.height; ++y)
+        done[y].store(0, std::memory_order_relaxed);
+
+    auto worker = [&](int first) {
+        std::vector<png_byte> scratch(size_t(src.width) * 4);
+        int* err_rows[MAX_KERNEL_ROWS];
+
+        for (int y = first; y < src.height; y += threads) {
+            for (int dy = 0; dy <= taps.max_dy; ++dy)
+                err_rows[dy] = &errors[((y + dy) % ring) * stride + pad_left * 4];
+
+            png_const_bytep row_src = src.row(y, scratch.data());
+
+            // Mirrored rows only happen single threaded, nothing waits on them
+            if (scan == SERPENTINE && (y & 1)) {
+                diffuse_row<true>(row_src, out.pixels[y], err_rows, 0, src.width, quantizer, channels, taps);
+                done[y].store(src.width, std::memory_order_release);
+            } else {
+                for (int from = 0; from < src.width; from += CHUNK) {
+                    int to = std::min(from + CHUNK, src.width);
+
+                    if (y > 0) {
+                        int needed = std::min(to - 1 + lag, src.width);
+                        while (done[y - 1].load(std::memory_order_acquire) < needed)
+                            std::this_thread::yield();
+                    }
+
+                    diffuse_row<false>(row_src, out.pixels[y], err_rows, from, to, quantizer, channels, taps);
+                    done[y].store(to, std::memory_order_release);
+                }
+            }
+
+            // Every row spreading into this one has finished, the slot
+            // becomes row y + ring
+            std::fill(err_rows[0] - pad_left * 4, err_rows[0] - pad_left * 4 + stride, 0);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; ++t)
+        pool.emplace_back(worker, t);
+    worker(0);
+    for (auto& thread : pool)
+        thread.join();
+}
+
+// Kernel given as a matrix at runtime, with F_P marking the current pixel.
+// Weights are divided by their sum, weights before F_P are ignored.
+struct Filter{
+private:
+    std::vector<std::vector<int>> m_data;
+    int m_sum = 0;
+
+    int m_px_x = -1;
+    int m_px_y = -1;
+
+    RuntimeTaps m_taps;
+public:
+    Filter(std::vector<std::vector<int>> const& _data) : m_data(_data) {
+        // Negative weights anywhere, even ignored ones, would lower the sum
+        // and let the error spread outgrow the LevelTable range
+        for (int y = 0; y < int(m_data.size()); ++y) {
+            for (int x = 0; x < int(m_data[y].size()); ++x) {
+                if (m_data[y][x] == F_P)
+                    m_px_x = x, m_px_y = y;
+                else if (m_data[y][x] < 0) abort();
+                else m_sum += m_data[y][x];
+            }
+        }
+
+        for (int y = 0; y < int(m_data.size()); ++y) {
+            for (int x = 0; x < int(m_data[y].size()); ++x) {
+                // Only pixels after the current one can take error
+                if (m_data[y][x] == 0 || y < m_px_y || (y == m_px_y && x <= m_px_x))
+                    continue;
+
+                if (m_taps.count == MAX_TAPS) abort();
+
+                int t = m_taps.count++;
+                m_taps.dx[t] = x - m_px_x;
+                m_taps.dy[t] = y - m_px_y;
+                m_taps.weight[t] = fixed_weight(m_data[y][x], m_sum);
+
+                m_taps.min_dx = std::min(m_taps.min_dx, m_taps.dx[t]);
+                m_taps.max_dx = std::max(m_taps.max_dx, m_taps.dx[t]);
+                m_taps.max_dy = std::max(m_taps.max_dy, m_taps.dy[t]);
+            }
+        }
+
+        if (m_taps.max_dy >= MAX_KERNEL_ROWS) abort();
+    }
+
+    // Reference: plain error diffusion with a full frame error buffer,
+    // bounds checks and err * w / sum divisions. dither() is bit-identical.
+    void dither_reference(
+        Image const& src,
+        Image& out,
+        int n,
+        int channels = RGB,
+        ScanOrder scan = RASTER
+    ) const {
+        if (!out.pixels)
+            src.same(out);
+        if (out.width != src.width || out.height != src.height) abort();
+        out.materialize();
+
+        png_byte levels[256];
+        uniform_levels(n, levels);
+
+        std::vector<int> errors(size_t(src.width) * src.height * 4, 0);
+        std::vector<png_byte> scratch(size_t(src.width) * 4);
+
+        for (int y = 0; y < src.height; ++y) {
+            bool reverse = scan == SERPENTINE && (y & 1);
+            png_const_bytep row_src = src.row(y, scratch.data());
+
+            for (int k = 0; k < src.width; ++k) {
+                int x = reverse ? src.width - 1 - k : k;
+                png_const_bytep px_src = &(row_src[x * 4]);
+                png_bytep px_out = &(out.pixels[y][x * 4]);
+
+                int err_px[4];
+                for (int i = 0; i < 4; ++i) {
+                    if (i >= channels) {
+                        px_out[i] = px_src[i];
+                        continue;
+                    }
+
+                    int value = px_src[i] + errors[(size_t(y) * src.width + x) * 4 + i];
+                    px_out[i] = levels[clamp_byte(value)];
+                    err_px[i] = value - px_out[i];
+                }
+
+                for (int f_y = m_px_y; f_y < int(m_data.size()); ++f_y) {
+                    for (int f_x = 0; f_x < int(m_data[f_y].size()); ++f_x) {
+                        int _x = reverse ? x - (f_x - m_px_x) : x + (f_x - m_px_x);
+                        int _y = y + f_y - m_px_y;
+
+                        if (
+                            _x < 0 || _x >= src.width ||
+                            _y < 0 || _y >= src.height
+                        ) continue;
+
+                        if (f_y == m_px_y && f_x <= m_px_x)
+                            continue;
+
+                        for (int i = 0; i < channels; ++i)
+                            errors[(size_t(_y) * src.width + _x) * 4 + i] += err_px[i] * m_data[f_y][f_x] / m_sum;
+                    }
+                }
+            }
+        }
+    }
+
+    void dither(
+        Image const& src,
+        Image& out,
+        int n,
+        int channels = RGB,
+        int threads = 1,
+        ScanOrder scan = RASTER
+    ) const {
+        diffuse(src, out, UniformQuantizer(n), channels, m_taps, threads, scan);
+    }
+
+    // Dither to the nearest colours of a palette, alpha is kept
+    void dither(
+        Image const& src,
+        Image& out,
+        Palette const& palette,
+        int threads = 1,
+        ScanOrder scan = RASTER
+    ) const {
+        diffuse(src, out, PaletteQuantizer(palette), RGB, m_taps, threads, scan);
+    }
+};
+
+inline Filter default_filter(
+    {
+        {0, F_P, 7} ,
+        {3, 5, 1}
+    }
+);
+
+// Compile-time kernels. Rows are listed top to bottom, * is the current pixel.
+
+//     *  7
+//  3  5  1     / 16
+struct FloydSteinbergKernel {
+    static constexpr int divisor = 16;
+    static constexpr KernelTap taps[] = {
+        {1, 0, 7},
+        {-1, 1, 3}, {0, 1, 5}, {1, 1, 1},
+    };
+};
+
+//        *  7  5
+//  3  5  7  5  3
+//  1  3  5  3  1     / 48
+struct JarvisJudiceNinkeKernel {
+    static constexpr int divisor = 48;
+    static constexpr KernelTap taps[] = {
+        {1, 0, 7}, {2, 0, 5},
+        {-2, 1, 3}, {-1, 1, 5}, {0, 1, 7}, {1, 1, 5}, {2, 1, 3},
+        {-2, 2, 1}, {-1, 2, 3}, {0, 2, 5}, {1, 2, 3}, {2, 2, 1},
+    };
+};
+
+//        *  8  4
+//  2  4  8  4  2
+//  1  2  4  2  1     / 42
+struct StuckiKernel {
+    static constexpr int divisor = 42;
+    static constexpr KernelTap taps[] = {
+        {1, 0, 8}, {2, 0, 4},
+        {-2, 1, 2}, {-1, 1, 4}, {0, 1, 8}, {1, 1, 4}, {2, 1, 2},
+        {-2, 2, 1}, {-1, 2, 2}, {0, 2, 4}, {1, 2, 2}, {2, 2, 1},
+    };
+};
+
+//        *  8  4
+//  2  4  8  4  2     / 32
+struct BurkesKernel {
+    static constexpr int divisor = 32;
+    static constexpr KernelTap taps[] = {
+        {1, 0, 8}, {2, 0, 4},
+        {-2, 1, 2}, {-1, 1, 4}, {0, 1, 8}, {1, 1, 4}, {2, 1, 2},
+    };
+};
+
+//        *  5  3
+//  2  4  5  4  2
+//     2  3  2        / 32
+struct SierraKernel {
+    static constexpr int divisor = 32;
+    static constexpr KernelTap taps[] = {
+        {1, 0, 5}, {2, 0, 3},
+        {-2, 1, 2}, {-1, 1, 4}, {0, 1, 5}, {1, 1, 4}, {2, 1, 2},
+        {-1, 2, 2}, {0, 2, 3}, {1, 2, 2},
+    };
+};
+
+//        *  4  3
+//  1  2  3  2  1     / 16
+struct TwoRowSierraKernel {
+    static constexpr int divisor = 16;
+    static constexpr KernelTap taps[] = {
+        {1, 0, 4}, {2, 0, 3},
+        {-2, 1, 1}, {-1, 1, 2}, {0, 1, 3}, {1, 1, 2}, {2, 1, 1},
+    };
+};
+
+//     *  2
+//  1  1        / 4
+struct SierraLiteKernel {
+    static constexpr int divisor = 4;
+    static constexpr KernelTap taps[] = {
+        {1, 0, 2},
+        {-1, 1, 1}, {0, 1, 1},
+    };
+};
+
+//     *  1  1
+//  1  1  1
+//     1           / 8, only 3/4 of the error is spread
+struct AtkinsonKernel {
+    static constexpr int divisor = 8;
+    static constexpr KernelTap taps[] = {
+        {1, 0, 1}, {2, 0, 1},
+        {-1, 1, 1}, {0, 1, 1}, {1, 1, 1},
+        {0, 2, 1},
+    };
+};
+
+//                 *     32
+//  12     26     30     16
+//      12     26     12
+//   5     12     12      5     / 200
+struct StevensonArceKernel {
+    static constexpr int divisor = 200;
+    static constexpr KernelTap taps[] = {
+        {2, 0, 32},
+        {-3, 1, 12}, {-1, 1, 26}, {1, 1, 30}, {3, 1, 16},
+        {-2, 2, 12}, {0, 2, 26}, {2, 2, 12},
+        {-3, 3, 5}, {-1, 3, 12}, {1, 3, 12}, {3, 3, 5},
+    };
+};
+
+enum DitherKernel {
+    FLOYD_STEINBERG,
+    JARVIS_JUDICE_NINKE,
+    STUCKI,
+    BURKES,
+    SIERRA,
+    TWO_ROW_SIERRA,
+    SIERRA_LITE,
+    ATKINSON,
+    STEVENSON_ARCE,
+};
+
+inline char const* kernel_name(DitherKernel kernel) {
+    switch (kernel) {
+    case FLOYD_STEINBERG: return "floyd-steinberg";
+    case JARVIS_JUDICE_NINKE: return "jarvis-judice-ninke";
+    case STUCKI: return "stucki";
+    case BURKES: return "burkes";
+    case SIERRA: return "sierra";
+    case TWO_ROW_SIERRA: return "two-row-sierra";
+    case SIERRA_LITE: return "sierra-lite";
+    case ATKINSON: return "atkinson";
+    case STEVENSON_ARCE: return "stevenson-arce";
+    }
+    return "";
+}
+
+// Calls func(StaticTaps<...>()) for the chosen kernel
+template<typename Func>
+void with_kernel(DitherKernel kernel, Func&& func) {
+    switch (kernel) {
+    case FLOYD_STEINBERG: func(StaticTaps<FloydSteinbergKernel>()); break;
+    case JARVIS_JUDICE_NINKE: func(StaticTaps<JarvisJudiceNinkeKernel>()); break;
+    case STUCKI: func(StaticTaps<StuckiKernel>()); break;
+    case BURKES: func(StaticTaps<BurkesKernel>()); break;
+    case SIERRA: func(StaticTaps<SierraKernel>()); break;
+    case TWO_ROW_SIERRA: func(StaticTaps<TwoRowSierraKernel>()); break;
+    case SIERRA_LITE: func(StaticTaps<SierraLiteKernel>()); break;
+    case ATKINSON: func(StaticTaps<AtkinsonKernel>()); break;
+    case STEVENSON_ARCE: func(StaticTaps<StevensonArceKernel>()); break;
+    }
+}
+
+// Dither with one of the built-in kernels, each one compiled into its own
+// fully unrolled diffusion loop
+inline void error_diffusion(
+    Image const& src,
+    Image& out,
+    int n,
+    DitherKernel kernel,
+    int channels = RGB,
+    int threads = 1,
+    ScanOrder scan = RASTER
+) {
+    with_kernel(kernel, [&](auto taps) {
+        diffuse(src, out, UniformQuantizer(n), channels, taps, threads, scan);
+    });
+}
+
+inline void error_diffusion(
+    Image const& src,
+    Image& out,
+    Palette const& palette,
+    DitherKernel kernel,
+    int threads = 1,
+    ScanOrder scan = RASTER
+) {
+    with_kernel(kernel, [&](auto taps) {
+        diffuse(src, out, PaletteQuantizer(palette), RGB, taps, threads, scan);
+    });
+}
+
+// Error diffusion in linear light: levels are still uniform in sRGB, but
+// are picked and their error spread by how much light they emit. Keeps
+// shadows from being crushed at low bit depths. Alpha is kept.
+inline void linear_error_diffusion(
+    Image const& src,
+    Image& out,
+    int n,
+    DitherKernel kernel,
+    int threads = 1,
+    ScanOrder scan = RASTER
+) {
+    with_kernel(kernel, [&](auto taps) {
+        diffuse(src, out, LinearQuantizer(n), RGB, taps, threads, scan);
+    });
+}
+
+inline void linear_error_diffusion(
+    Image const& src,
+    Image& out,
+    Palette const& palette,
+    DitherKernel kernel,
+    int threads = 1,
+    ScanOrder scan = RASTER
+) {
+    Palette search = LinearPaletteQuantizer::search_palette(palette);
+    with_kernel(kernel, [&](auto taps) {
+        diffuse(src, out, LinearPaletteQuantizer(palette, search), RGB, taps, threads, scan);
+    });
+}
+
+// In place versions
+inline void FloydStainberg(
+    Image& img,
+    int n,
+    Filter const& filter,
+    int channels = RGB
+) {
+    filter.dither(img, img, n, channels);
+}
+
+inline void FloydStainberg(
+    Image& img,
+    int n,
+    int channels = RGB
+) {
+    error_diffusion(img, img, n, FLOYD_STEINBERG, channels);
+}
+
+// Dither src to every bit depth in depths at once. src is decoded once and
+// only read; each depth gets its own output and worker, and spare cores go
+// to the wavefront of each depth. Finished images are handed to
+// encode(n, image) on a separate thread, so writing one result overlaps
+// dithering the others. Images are freed after encode returns.
+template<typename Encode>
+void dither_multi(
+    Image const& src,
+    std::vector<int> const& depths,
+    Encode&& encode,
+    DitherKernel kernel = FLOYD_STEINBERG,
+    int channels = RGB
+) {
+    int count = int(depths.size());
+    if (!count)
+        return;
+
+    int cores = std::max(1, int(std::thread::hardware_concurrency()));
+    int workers = std::min(count, cores);
+    int threads = std::max(1, cores / workers);
+
+    std::vector<std::unique_ptr<Image>> results(count);
+    std::atomic<int> next(0);
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::vector<int> finished;
+
+    std::thread encoder([&] {
+        for (int encoded = 0; encoded < count; ++encoded) {
+            int i;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [&] { return !finished.empty(); });
+                i = finished.front();
+                finished.erase(finished.begin());
+            }
+            encode(depths[i], static_cast<Image const&>(*results[i]));
+            results[i].reset();
+        }
+    });
+
+    auto worker = [&] {
+        for (int i = next++; i < count; i = next++) {
+            results[i].reset(new Image());
+            error_diffusion(src, *results[i], depths[i], kernel, channels, threads);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                finished.push_back(i);
+            }
+            ready.notify_one();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < workers; ++t)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& thread : pool)
+        thread.join();
+    encoder.join();
+}
+
+// Ordered dithering: every pixel is compared against a threshold from a map
+// tiled over the image, so rows are independent of each other.
+
+// Thresholds in [0, 1), kept as 4 floats per cell (one per channel) so a
+// whole RGBA pixel is offset by a single load
+struct ThresholdMap {
+    int width = 0, height = 0;
+    std::vector<float> thresholds;
+
+    // ranks: width * height values in [0, levels)
+    ThresholdMap(int _width, int _height, std::vector<int> const& ranks, int levels)
+        : width(_width), height(_height), thresholds(size_t(_width) * _height * 4) {
+        for (size_t i = 0; i < ranks.size(); ++i)
+            for (int c = 0; c < 4; ++c)
+                thresholds[i * 4 + c] = (ranks[i] + 0.5f) / levels;
+    }
+
+    float const* row(int y) const {
+        return &thresholds[size_t(y % height) * width * 4];
+    }
+};
+
+// Bayer matrix of size 2^order x 2^order
+inline ThresholdMap bayer_map(int order) {
+    int size = 1 << order;
+    std::vector<int> ranks(size_t(size) * size, 0);
+
+    // M(2s) = [4M, 4M + 2; 4M + 3, 4M + 1]
+    for (int s = 1; s < size; s *= 2) {
+        for (int y = 0; y < s; ++y) {
+            for (int x = 0; x < s; ++x) {
+                int m = 4 * ranks[y * size + x];
+                ranks[y * size + x] = m;
+                ranks[y * size + x + s] = m + 2;
+                ranks[(y + s) * size + x] = m + 3;
+                ranks[(y + s) * size + x + s] = m + 1;
+            }
+        }
+    }
+
+    return ThresholdMap(size, size, ranks, size * size);
+}
+
+// Tileable blue noise built with void-and-cluster: points are ranked by
+// repeatedly taking the tightest cluster out of, or filling the largest
+// void in, a binary pattern under a toroidal Gaussian energy
+inline ThresholdMap blue_noise_map(int size = 64, unsigned seed = 1) {
+    if (size < 1) abort();
+    int count = size * size;
+    const float sigma = 1.5f;
+
+    // Energy contribution of a point at each toroidal offset
+    std::vector<float> kernel(count);
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            int dx = std::min(x, size - x), dy = std::min(y, size - y);
+            kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+        }
+    }
+
+    std::vector<char> pattern(count, 0);
+    std::vector<float> energy(count, 0.f);
+
+    auto toggle = [&](int p, bool on) {
+        pattern[p] = on;
+        int px = p % size, py = p / size;
+        float sign = on ? 1.f : -1.f;
+        for (int y = 0; y < size; ++y)
+            for (int x = 0; x < size; ++x)
+                energy[y * size + x] += sign * kernel[((y - py + size) % size) * size + (x - px + size) % size];
+    };
+
+    // Tightest cluster among set points, or largest void among empty ones.
+    // Callers only ask while there is one of each.
+    auto extreme = [&](bool set) {
+        int best = -1;
+        for (int p = 0; p < count; ++p)
+            if (pattern[p] == set && (best < 0 || (set ? energy[p] > energy[best] : energy[p] < energy[best])))
+                best = p;
+        if (best < 0) abort();
+        return best;
+    };
+
+    // Random initial pattern with a tenth of the points set
+    unsigned state = seed;
+    int initial = std::max(1, count / 10);
+    for (int placed = 0; placed < initial;) {
+        state = state * 1664525u + 1013904223u;
+        int p = int((state >> 8) % unsigned(count));
+        if (!pattern[p]) {
+            toggle(p, true);
+            ++placed;
+        }
+    }
+
+    // Move points from clusters to voids until that stops changing anything
+    for (;;) {
+        int cluster = extreme(true);
+        toggle(cluster, false);
+        int gap = extreme(false);
+        toggle(gap, true);
+        if (gap == cluster)
+            break;
+    }
+
+    std::vector<char> prototype = pattern;
+    std::vector<float> prototype_energy = energy;
+    std::vector<int> ranks(count, 0);
+
+    for (int rank = initial - 1; rank >= 0; --rank) {
+        int cluster = extreme(true);
+        toggle(cluster, false);
+        ranks[cluster] = rank;
+    }
+
+    pattern = prototype;
+    energy = prototype_energy;
+    for (int rank = initial; rank < count; ++rank) {
+        int gap = extreme(false);
+        toggle(gap, true);
+        ranks[gap] = rank;
+    }
+
+    return ThresholdMap(size, size, ranks, count);
+}
+
+// Threshold texture from the first channel of an image, e.g. a
+// precomputed blue noise tile
+inline ThresholdMap threshold_map(Image const& texture) {
+    std::vector<int> ranks(size_t(texture.width) * texture.height);
+    std::vector<png_byte> scratch(size_t(texture.width) * 4);
+
+    for (int y = 0; y < texture.height; ++y) {
+        png_bytep row = texture.row(y, scratch.data());
+        for (int x = 0; x < texture.width; ++x)
+            ranks[size_t(y) * texture.width + x] = row[x * 4];
+    }
+
+    return ThresholdMap(texture.width, texture.height, ranks, 256);
+}
+
+// One row of ordered dithering to 1 << n levels per channel:
+// level index = floor(v * (colors - 1) / 255 + threshold), mapped to its
+// output byte by level_table(n). Four pixels at a time with SSE2, where
+// the byte is computed with the same float ops the table was built with
+// (SSE2 has no byte gather).
+inline void ordered_row(
+    png_const_bytep row_src,
+    png_bytep row_out,
+    int width,
+    float const* thresholds,
+    int map_width,
+    int n,
+    int channels
+) {
+    int colors = 1 << n;
+    float scale = (colors - 1) / 255.f;
+    png_byte const* levels = level_table(n).level;
+
+    int x = 0, map_x = 0;
+
+#ifdef PIXEL_OPS_SSE2
+    __m128i zero = _mm_setzero_si128();
+    // Bytes of the channels past the dithered ones, copied from the source
+    __m128i keep = _mm_set1_epi32(channels >= 4 ? 0 : int(0xFFFFFFFFu << (8 * channels)));
+    __m128 v_scale = _mm_set1_ps(scale);
+    __m128 v_step = _mm_set1_ps(255.f / float(colors - 1));
+    __m128 v_max = _mm_set1_ps(float(colors - 1));
+
+    auto level = [&](__m128i px) {
+        __m128 t = _mm_loadu_ps(thresholds + map_x * 4);
+        map_x = map_x + 1 == map_width ? 0 : map_x + 1;
+
+        __m128 index = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(px), v_scale), t);
+        index = _mm_min_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(index)), v_max);
+        return _mm_cvttps_epi32(_mm_mul_ps(index, v_step));
+    };
+
+    for (; x + 4 <= width; x += 4) {
+        __m128i px = _mm_loadu_si128((__m128i const*)(row_src + x * 4));
+        __m128i lo = _mm_unpacklo_epi8(px, zero);
+        __m128i hi = _mm_unpackhi_epi8(px, zero);
+
+        __m128i p0 = level(_mm_unpacklo_epi16(lo, zero));
+        __m128i p1 = level(_mm_unpackhi_epi16(lo, zero));
+        __m128i p2 = level(_mm_unpacklo_epi16(hi, zero));
+        __m128i p3 = level(_mm_unpackhi_epi16(hi, zero));
+
+        __m128i q = _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+        q = _mm_or_si128(_mm_andnot_si128(keep, q), _mm_and_si128(keep, px));
+        _mm_storeu_si128((__m128i*)(row_out + x * 4), q);
+    }
+#endif
+
+    for (; x < width; ++x) {
+        float const* t = thresholds + map_x * 4;
+        map_x = map_x + 1 == map_width ? 0 : map_x + 1;
+
+        for (int i = 0; i < channels; ++i) {
+            int index = int(row_src[x * 4 + i] * scale + t[i]);
+            row_out[x * 4 + i] = levels[index];
+        }
+        for (int i = channels; i < 4; ++i)
+            row_out[x * 4 + i] = row_src[x * 4 + i];
+    }
+}
+
+// Ordered dithering of the whole image, rows split across threads
+inline void ordered_dither(
+    Image const& src,
+    Image& out,
+    int n,
+    ThresholdMap const& map,
+    int channels = RGB
+) {
+    if (!out.pixels)
+        src.same(out);
+    if (out.width != src.width || out.height != src.height) abort();
+    out.materialize();
+
+    parallel_for(0, src.height, [&](int from, int to) {
+        std::vector<png_byte> scratch(size_t(src.width) * 4);
+        for (int y = from; y < to; ++y)
+            ordered_row(src.row(y, scratch.data()), out.pixels[y], src.width, map.row(y), map.width, n, channels);
+    }, 16);
+}
@@ -0,0 +1,304 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <stdint.h>
+#include "png_files.h"
+#include "parallel.h"
+#include "colorspace.h"
+
+// Per channel histograms of RGBA images and the tone adjustments built on
+// them: equalization, auto levels and CLAHE. Adjustments are byte tables,
+// one per channel, applied in a single pass. channels = 3 leaves alpha
+// alone, channels = 1 touches only the first channel (Y of a YCbCr image).
+
+struct Histogram {
+    uint32_t counts[4][256];
+    uint64_t total = 0;
+
+    Histogram() {
+        clear();
+    }
+
+    void clear() {
+        std::fill(&counts[0][0], &counts[0][0] + 4 * 256, 0u);
+        total = 0;
+    }
+
+    void add(Histogram const& other) {
+        for (int c = 0; c < 4; ++c)
+            for (int v = 0; v < 256; ++v)
+                counts[c][v] += other.counts[c][v];
+        total += other.total;
+    }
+
+    // Pixel count a fraction stands for, in double: a float holds counts
+    // exactly only up to 2^24
+    double part(float fraction) const {
+        return double(fraction) * double(total);
+    }
+
+    // Smallest value with more than fraction of the pixels at or below it
+    int low(int channel, float fraction) const {
+        double const threshold = part(fraction);
+        uint64_t below = 0;
+        for (int v = 0; v < 256; ++v) {
+            below += counts[channel][v];
+            if (double(below) > threshold)
+                return v;
+        }
+        return 255;
+    }
+
+    // Largest value with more than fraction of the pixels at or above it
+    int high(int channel, float fraction) const {
+        double const threshold = part(fraction);
+        uint64_t above = 0;
+        for (int v = 255; v >= 0; --v) {
+            above += counts[channel][v];
+            if (double(above) > threshold)
+                return v;
+        }
+        return 0;
+    }
+};
+
+// Adds pixels [from, to) of a row. Consecutive pixels go to four separate
+// sub-histograms, so runs of one value do not make every increment wait
+// for the store of the one before.
+inline void count_pixels(png_const_bytep row, int from, int to, uint32_t (*sub)[4][256]) {
+    int x = from;
+    for (; x + 4 <= to; x += 4)
+        for (int s = 0; s < 4; ++s) {
+            png_const_bytep px = row + (x + s) * 4;
+            ++sub[s][0][px[0]], ++sub[s][1][px[1]], ++sub[s][2][px[2]], ++sub[s][3][px[3]];
+        }
+    for (; x < to; ++x) {
+        png_const_bytep px = row + x * 4;
+        ++sub[0][0][px[0]], ++sub[0][1][px[1]], ++sub[0][2][px[2]], ++sub[0][3][px[3]];
+    }
+}
+
+// Sub-histograms per thread, merged once per thread at the end
+inline void histogram(Image const& src, Histogram& out) {
+    out.clear();
+    std::mutex merge;
+
+    parallel_for(0, src.height, [&](int from, int to) {
+        std::vector<png_byte> scratch(size_t(src.width) * 4);
+        std::vector<uint32_t> storage(4 * 4 * 256, 0u);
+        uint32_t (*sub)[4][256] = (uint32_t (*)[4][256])storage.data();
+
+        for (int y = from; y < to; ++y)
+            count_pixels(src.row(y, scratch.data()), 0, src.width, sub);
+
+        Histogram local;
+        for (int s = 0; s < 4; ++s)
+            for (int c = 0; c < 4; ++c)
+                for (int v = 0; v < 256; ++v)
+                    local.counts[c][v] += sub[s][c][v];
+        local.total = uint64_t(to - from) * src.width;
+
+        std::lock_guard<std::mutex> lock(merge);
+        out.add(local);
+    }, 64);
+}
+
+inline Histogram histogram(Image const& src) {
+    Histogram out;
+    histogram(src, out);
+    return out;
+}
+
+// A byte table per channel, identity when built
+struct ChannelLut {
+    png_byte table[4][256];
+
+    ChannelLut() {
+        for (int c = 0; c < 4; ++c)
+            for (int v = 0; v < 256; ++v)
+                table[c][v] = png_byte(v);
+    }
+
+    void operator()(png_const_bytep in, png_bytep out, int width) const {
+        for (int x = 0; x < width; ++x) {
+            png_const_bytep px = in + x * 4;
+            png_byte r = table[0][px[0]], g = table[1][px[1]], b = table[2][px[2]], a = table[3][px[3]];
+            out[x * 4 + 0] = r, out[x * 4 + 1] = g, out[x * 4 + 2] = b, out[x * 4 + 3] = a;
+        }
+    }
+};
+
+// One pass over the rows, four lookups per pixel. SSE2 has no byte
+// shuffle or gather to vectorize them, rows are split across threads.
+inline void apply_lut(Image const& src, Image& out, ChannelLut const& lut) {
+    convert_rows(src, out, lut);
+}
+
+// Spreads values so that the cumulative histogram becomes a straight line
+inline ChannelLut equalize_lut(Histogram const& histogram, int channels = 3) {
+    ChannelLut lut;
+    for (int c = 0; c < channels; ++c) {
+        uint32_t const* counts = histogram.counts[c];
+        uint64_t first = 0;
+        for (int v = 0; v < 256 && !first; ++v)
+            first = counts[v];
+        if (histogram.total == first)
+            continue;
+
+        uint64_t below = 0, range = histogram.total - first;
+        for (int v = 0; v < 256; ++v) {
+            below += counts[v];
+            uint64_t rank = below > first ? below - first : 0;
+            lut.table[c][v] = png_byte((rank * 255 + range / 2) / range);
+        }
+    }
+    return lut;
+}
+
+// Stretches every channel so that a clip fraction of its pixels falls
+// below 0 and above 255
+inline ChannelLut auto_levels_lut(Histogram const& histogram, float clip = 0.005f, int channels = 3) {
+    ChannelLut lut;
+    for (int c = 0; c < channels; ++c) {
+        int low = histogram.low(c, clip), high = histogram.high(c, clip);
+        if (high <= low)
+            continue;
+        for (int v = 0; v < 256; ++v) {
+            int stretched = ((v - low) * 255 * 2 + (high - low)) / (2 * (high - low));
+            lut.table[c][v] = png_byte(std::min(std::max(v <= low ? 0 : stretched, 0), 255));
+        }
+    }
+    return lut;
+}
+
+inline void equalize(Image const& src, Image& out, int channels = 3) {
+    apply_lut(src, out, equalize_lut(histogram(src), channels));
+}
+
+inline void auto_levels(Image const& src, Image& out, float clip = 0.005f, int channels = 3) {
+    apply_lut(src, out, auto_levels_lut(histogram(src), clip, channels));
+}
+
+// Equalization table of one CLAHE tile: bins above the clip limit are
+// cut and the excess spread over all bins, which bounds the contrast gain
+inline void clahe_tile_lut(uint32_t const* counts, int area, float clip_limit, png_byte* table) {
+    int limit = std::max(1, int(clip_limit * area / 256));
+    uint32_t clipped[256];
+    int excess = 0;
+    for (int v = 0; v < 256; ++v) {
+        int over = std::max(0, int(counts[v]) - limit);
+        excess += over;
+        clipped[v] = counts[v] - over;
+    }
+
+    int each = excess / 256, rest = excess % 256;
+    for (int v = 0; v < 256; ++v)
+        clipped[v] += each;
+    if (rest)
+        for (int v = 0, step = 256 / rest; v < 256 && rest; v += step, --rest)
+            ++clipped[v];
+
+    uint64_t below = 0;
+    for (int v = 0; v < 256; ++v) {
+        below += clipped[v];
+        table[v] = png_byte(std::min<uint64_t>(255, (below * 255 + area / 2) / area));
+    }
+}
+
+// Contrast limited adaptive histogram equalization: an equalization table
+// per tile of a tiles x tiles grid, clipped at clip_limit times the mean
+// bin, and every pixel mapped through the four nearest tile tables
+// weighted by distance to the tile centers
+inline void clahe(Image const& src, Image& out, float clip_limit = 2.f, int tiles = 8, int channels = 3) {
+    if (!out.pixels)
+        src.same(out);
+    if (out.width != src.width || out.height != src.height) abort();
+    // In place this orients src too, it is read the same either way
+    out.materialize();
+
+    // No pixels, no tiles to equalize
+    if (src.width == 0 || src.height == 0)
+        return;
+
+    int const tiles_x = std::max(1, std::min(tiles, src.width));
+    int const tiles_y = std::max(1, std::min(tiles, src.height));
+    auto tile_start = [](int tile, int tiles, int size) { return int((long long)size * tile / tiles); };
+
+    std::vector<int> tile_of(src.width);
+    for (int t = 0; t < tiles_x; ++t)
+        for (int x = tile_start(t, tiles_x, src.width); x < tile_start(t + 1, tiles_x, src.width); ++x)
+            tile_of[x] = t;
+
+    // Tables of every tile, one row of tiles per task
+    std::vector<ChannelLut> luts(size_t(tiles_x) * tiles_y);
+    parallel_for(0, tiles_y, [&](int from, int to) {
+        std::vector<png_byte> scratch(size_t(src.width) * 4);
+        std::vector<Histogram> counts(tiles_x);
+
+        for (int ty = from; ty < to; ++ty) {
+            for (Histogram& h : counts)
+                h.clear();
+
+            int y0 = tile_start(ty, tiles_y, src.height), y1 = tile_start(ty + 1, tiles_y, src.height);
+            for (int y = y0; y < y1; ++y) {
+                png_const_bytep row = src.row(y, scratch.data());
+                for (int x = 0; x < src.width; ++x)
+                    for (int c = 0; c < channels; ++c)
+                        ++counts[tile_of[x]].counts[c][row[x * 4 + c]];
+            }
+
+            for (int tx = 0; tx < tiles_x; ++tx) {
+                int area = (y1 - y0) * (tile_start(tx + 1, tiles_x, src.width) - tile_start(tx, tiles_x, src.width));
+                for (int c = 0; c < channels; ++c)
+                    clahe_tile_lut(counts[tx].counts[c], area, clip_limit, luts[size_t(ty) * tiles_x + tx].table[c]);
+            }
+        }
+    });
+
+    // Left (or upper) tile and 8-bit weight of the next one, per column
+    // and per row. Half tiles along the edges use the nearest table.
+    struct Blend { int tile, weight; };
+    auto blends = [&](int tiles, int size) {
+        std::vector<Blend> out(size);
+        for (int i = 0; i < size; ++i) {
+            int t = 0;
+            while (t + 1 < tiles && 2 * i + 1 >= tile_start(t + 1, tiles, size) + tile_start(t + 2, tiles, size))
+                ++t;
+            int center = tile_start(t, tiles, size) + tile_start(t + 1, tiles, size);
+            int next = t + 1 < tiles ? tile_start(t + 1, tiles, size) + tile_start(t + 2, tiles, size) : center;
+            int weight = next > center ? std::min(256, std::max(0, (2 * i + 1 - center) * 256 / (next - center))) : 0;
+            out[i] = { t, weight };
+        }
+        return out;
+    };
+    std::vector<Blend> columns = blends(tiles_x, src.width), rows = blends(tiles_y, src.height);
+
+    parallel_for(0, src.height, [&](int from, int to) {
+        std::vector<png_byte> scratch(size_t(src.width) * 4);
+        for (int y = from; y < to; ++y) {
+            png_const_bytep in = src.row(y, scratch.data());
+            png_bytep row = out.pixels[y];
+            Blend vertical = rows[y];
+            ChannelLut const* upper = &luts[size_t(vertical.tile) * tiles_x];
+            ChannelLut const* lower = &luts[size_t(std::min(vertical.tile + 1, tiles_y - 1)) * tiles_x];
+
+            for (int x = 0; x < src.width; ++x) {
+                Blend horizontal = columns[x];
+                int left = horizontal.tile, right = std::min(left + 1, tiles_x - 1);
+                int wx = horizontal.weight, wy = vertical.weight;
+
+                for (int c = 0; c < 4; ++c) {
+                    int v = in[x * 4 + c];
+                    if (c >= channels) {
+                        row[x * 4 + c] = png_byte(v);
+                        continue;
+                    }
+                    int top = upper[left].table[c][v] * (256 - wx) + upper[right].table[c][v] * wx;
+                    int bottom = lower[left].table[c][v] * (256 - wx) + lower[right].table[c][v] * wx;
+                    row[x * 4 + c] = png_byte((top * (256 - wy) + bottom * wy + 32768) >> 16);
+                }
+            }
+        }
+    }, 16);
+}
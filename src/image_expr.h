@@ -0,0 +1,219 @@
+#pragma once
+#include <type_traits>
+#include <algorithm>
+#include <vector>
+#include "png_files.h"
+#include "parallel.h"
+
+// Expression templates for per-pixel arithmetic on RGBA images:
+//
+//     out = lerp(b, a, alpha(mask));
+//     out = clamp(a * 1.2f - 10);
+//
+// The right hand side only builds a tree of small structs, the whole tree is
+// evaluated channel by channel in one loop per row when it is assigned, with
+// no intermediate images. Values are floats in 0..255 (alpha() is 0..1) and
+// are rounded and saturated when stored. Images are read through their
+// orientation; out is materialized before it is written.
+
+struct ExprBase {};
+
+// Per thread row buffers for the oriented images of an expression. Terms
+// take them in the same order for every row, so after the first row no
+// more are allocated.
+struct RowScratch {
+    std::vector<std::vector<png_byte>> buffers;
+    size_t used = 0;
+
+    png_bytep take(size_t bytes) {
+        if (used == buffers.size())
+            buffers.emplace_back();
+        std::vector<png_byte>& buffer = buffers[used++];
+        if (buffer.size() < bytes)
+            buffer.resize(bytes);
+        return buffer.data();
+    }
+
+    void reset() {
+        used = 0;
+    }
+};
+
+template<typename Derived>
+struct Expr : ExprBase {
+    using is_image_expr = void;
+
+    Derived const& self() const {
+        return static_cast<Derived const&>(*this);
+    }
+};
+
+struct ImageTerm : Expr<ImageTerm> {
+    Image const& img;
+
+    struct Row {
+        png_const_bytep p;
+        float operator[](int i) const { return p[i]; }
+    };
+
+    ImageTerm(Image const& _img) : img(_img) {}
+
+    // Stored rows are used as they are, only mirrored or transposed rows
+    // are gathered
+    Row row(int y, RowScratch& scratch) const {
+        bool gathered = img.orientation & (ORIENT_FLIP_X | ORIENT_TRANSPOSE);
+        return { img.row(y, gathered ? scratch.take(size_t(img.width) * 4) : nullptr) };
+    }
+    int width() const { return img.width; }
+    int height() const { return img.height; }
+    bool fits(int w, int h) const { return img.width == w && img.height == h; }
+};
+
+struct Constant : Expr<Constant> {
+    float value;
+
+    struct Row {
+        float value;
+        float operator[](int) const { return value; }
+    };
+
+    Constant(float _value) : value(_value) {}
+
+    Row row(int, RowScratch&) const { return { value }; }
+    int width() const { return -1; }
+    int height() const { return -1; }
+    bool fits(int, int) const { return true; }
+};
+
+// Alpha of the pixel scaled to 0..1, the same for all four channels
+template<typename E>
+struct AlphaExpr : Expr<AlphaExpr<E>> {
+    E e;
+
+    struct Row {
+        typename E::Row r;
+        float operator[](int i) const { return r[i | 3] * (1.f / 255.f); }
+    };
+
+    AlphaExpr(E const& _e) : e(_e) {}
+
+    Row row(int y, RowScratch& scratch) const { return { e.row(y, scratch) }; }
+    int width() const { return e.width(); }
+    int height() const { return e.height(); }
+    bool fits(int w, int h) const { return e.fits(w, h); }
+};
+
+template<typename Op, typename L, typename R>
+struct BinaryExpr : Expr<BinaryExpr<Op, L, R>> {
+    L l;
+    R r;
+
+    struct Row {
+        typename L::Row l;
+        typename R::Row r;
+        float operator[](int i) const { return Op::apply(l[i], r[i]); }
+    };
+
+    BinaryExpr(L const& _l, R const& _r) : l(_l), r(_r) {}
+
+    Row row(int y, RowScratch& scratch) const { return { l.row(y, scratch), r.row(y, scratch) }; }
+    int width() const { return std::max(l.width(), r.width()); }
+    int height() const { return std::max(l.height(), r.height()); }
+    bool fits(int w, int h) const { return l.fits(w, h) && r.fits(w, h); }
+};
+
+struct OpAdd { static float apply(float a, float b) { return a + b; } };
+struct OpSub { static float apply(float a, float b) { return a - b; } };
+struct OpMul { static float apply(float a, float b) { return a * b; } };
+struct OpDiv { static float apply(float a, float b) { return a / b; } };
+// Plain selects, std::min/max return references and block vectorization
+struct OpMin { static float apply(float a, float b) { return a < b ? a : b; } };
+struct OpMax { static float apply(float a, float b) { return a > b ? a : b; } };
+
+template<typename E>
+E const& as_expr(Expr<E> const& e) { return e.self(); }
+
+inline ImageTerm as_expr(Image const& img) { return ImageTerm(img); }
+
+inline Constant as_expr(float value) { return Constant(value); }
+
+template<typename T>
+using expr_t = typename std::decay<decltype(as_expr(std::declval<T const&>()))>::type;
+
+// Operators and functions only kick in when an image or expression is involved
+template<typename T>
+struct is_operand : std::integral_constant<bool,
+    std::is_base_of<ExprBase, T>::value || std::is_same<T, Image>::value> {};
+
+template<typename L, typename R>
+using enable_operands_t = typename std::enable_if<is_operand<L>::value || is_operand<R>::value>::type;
+
+#define IMAGE_EXPR_BINARY(name, Op) \
+    template<typename L, typename R, typename = enable_operands_t<L, R>> \
+    BinaryExpr<Op, expr_t<L>, expr_t<R>> name(L const& l, R const& r) { \
+        return { as_expr(l), as_expr(r) }; \
+    }
+
+IMAGE_EXPR_BINARY(operator+, OpAdd)
+IMAGE_EXPR_BINARY(operator-, OpSub)
+IMAGE_EXPR_BINARY(operator*, OpMul)
+IMAGE_EXPR_BINARY(operator/, OpDiv)
+IMAGE_EXPR_BINARY(min, OpMin)
+IMAGE_EXPR_BINARY(max, OpMax)
+
+#undef IMAGE_EXPR_BINARY
+
+template<typename T, typename = enable_operands_t<T, T>>
+AlphaExpr<expr_t<T>> alpha(T const& e) {
+    return { as_expr(e) };
+}
+
+// a + (b - a) * t
+template<typename A, typename B, typename T, typename = enable_operands_t<A, B>>
+auto lerp(A const& a, B const& b, T const& t) -> decltype(as_expr(a) + (as_expr(b) - as_expr(a)) * as_expr(t)) {
+    return as_expr(a) + (as_expr(b) - as_expr(a)) * as_expr(t);
+}
+
+template<typename E, typename = enable_operands_t<E, E>>
+auto clamp(E const& e, float lo = 0.f, float hi = 255.f) -> decltype(min(max(as_expr(e), lo), hi)) {
+    return min(max(as_expr(e), lo), hi);
+}
+
+// Evaluate expr into out, allocating out from the expression's images if
+// needed. Aborts when the images in the expression differ in size.
+template<typename E>
+void evaluate(Image& out, Expr<E> const& expr) {
+    E const& e = expr.self();
+
+    if (!out.pixels) {
+        if (e.width() < 0) abort();
+
+        out.create(e.width(), e.height());
+    }
+
+    if (!e.fits(out.width, out.height)) abort();
+    // When out is also an operand, this orients it once for both
+    out.materialize();
+
+    parallel_for(0, out.height, [&](int from, int to) {
+        // Local copy, stores through png_bytep may alias anything captured
+        int const n = out.width * 4;
+        RowScratch scratch;
+
+        for (int y = from; y < to; ++y) {
+            scratch.reset();
+            auto row = e.row(y, scratch);
+            png_bytep row_out = out.pixels[y];
+
+            // Saturate in float before converting: int() of inf or NaN (a
+            // division by a zero pixel) is undefined. NaN fails v > 0 and
+            // becomes 0.
+            for (int i = 0; i < n; ++i) {
+                float value = row[i];
+                value = value > 0.f ? value : 0.f;
+                value = value < 255.f ? value : 255.f;
+                row_out[i] = png_byte(int(value + 0.5f));
+            }
+        }
+    }, 16);
+}
@@ -0,0 +1,260 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <stdint.h>
+#include "png_files.h"
+#include "parallel.h"
+#include "pixel_ops.h"
+
+// Summed-area table: entry (x, y) holds the per channel sums of all pixels
+// above and to the left of it, so any rectangle sum is four lookups.
+//
+// The table is (width + 1) x (height + 1) entries of four channels with a
+// zero first row and column. Entries are 32 bit when 255 * width * height
+// fits, 64 bit otherwise. Unsigned overflow in the table itself would not
+// matter: rectangle sums are differences and come out right modulo 2^32
+// as long as they fit, which is what the size check guarantees.
+class SummedAreaTable {
+private:
+    std::unique_ptr<uint32_t[]> m_narrow;
+    std::unique_ptr<uint64_t[]> m_wide;
+    size_t m_entries = 0;
+
+    size_t _stride() const {
+        return size_t(width + 1) * 4;
+    }
+
+    // Row y of the table, the first four channels of every row are zero
+    template<typename T>
+    void _sum_row(png_const_bytep row, T const* above, T* sums) const {
+        for (int c = 0; c < 4; ++c)
+            sums[c] = 0;
+
+        T run[4] = { 0, 0, 0, 0 };
+        for (int x = 0; x < width; ++x)
+            for (int c = 0; c < 4; ++c) {
+                run[c] += row[x * 4 + c];
+                sums[(x + 1) * 4 + c] = above[(x + 1) * 4 + c] + run[c];
+            }
+    }
+
+#ifdef PIXEL_OPS_SSE2
+    void _sum_row(png_const_bytep row, uint32_t const* above, uint32_t* sums) const {
+        __m128i const zero = _mm_setzero_si128();
+        __m128i run = zero;
+        _mm_storeu_si128((__m128i*)sums, zero);
+        for (int x = 0; x < width; ++x) {
+            __m128i px = _mm_cvtsi32_si128(*(int const*)(row + x * 4));
+            run = _mm_add_epi32(run, _mm_unpacklo_epi16(_mm_unpacklo_epi8(px, zero), zero));
+            __m128i up = _mm_loadu_si128((__m128i const*)(above + (x + 1) * 4));
+            _mm_storeu_si128((__m128i*)(sums + (x + 1) * 4), _mm_add_epi32(up, run));
+        }
+    }
+#endif
+
+    // Each band of rows is summed on its own, starting from zero, then the
+    // last row of every band is carried into the bands below it. Storage is
+    // kept when the size does not change.
+    template<typename T>
+    void _build(Image const& src, std::unique_ptr<T[]>& storage) {
+        size_t const stride = _stride();
+        if (!storage || m_entries != stride * (height + 1)) {
+            m_entries = stride * (height + 1);
+            storage.reset(new T[m_entries]);
+        }
+        T* table = storage.get();
+        std::fill(table, table + stride, T(0));
+
+        int threads = std::max(1, int(std::thread::hardware_concurrency()));
+        int bands = std::max(1, std::min(threads, height / 64));
+        auto band_start = [&](int band) { return int((long long)height * band / bands); };
+
+        parallel_for(0, bands, [&](int band_from, int band_to) {
+            std::vector<png_byte> scratch(size_t(width) * 4);
+
+            for (int band = band_from; band < band_to; ++band)
+                for (int y = band_start(band); y < band_start(band + 1); ++y) {
+                    // The first row of a band adds to the zero row
+                    T const* above = y == band_start(band) ? table : &table[stride * y];
+                    _sum_row(src.row(y, scratch.data()), above, &table[stride * (y + 1)]);
+                }
+        });
+
+        if (bands == 1)
+            return;
+
+        // Last rows of the bands become final one after another
+        for (int band = 1; band < bands; ++band) {
+            T const* carry = &table[stride * band_start(band)];
+            T* last = &table[stride * band_start(band + 1)];
+            for (size_t i = 0; i < stride; ++i)
+                last[i] += carry[i];
+        }
+
+        parallel_for(1, bands, [&](int band_from, int band_to) {
+            for (int band = band_from; band < band_to; ++band) {
+                T const* carry = &table[stride * band_start(band)];
+                for (int y = band_start(band) + 1; y < band_start(band + 1); ++y) {
+                    T* sums = &table[stride * y];
+                    for (size_t i = 0; i < stride; ++i)
+                        sums[i] += carry[i];
+                }
+            }
+        });
+    }
+
+    template<typename T>
+    void _sums(T const* table, int x0, int y0, int x1, int y1, uint64_t out[4]) const {
+        T const* top = &table[_stride() * y0];
+        T const* bottom = &table[_stride() * y1];
+        for (int c = 0; c < 4; ++c)
+            out[c] = T(bottom[x1 * 4 + c] - bottom[x0 * 4 + c] - top[x1 * 4 + c] + top[x0 * 4 + c]);
+    }
+
+public:
+    int width = 0, height = 0;
+
+    SummedAreaTable() {}
+
+    SummedAreaTable(Image const& src) {
+        build(src);
+    }
+
+    void build(Image const& src) {
+        width = src.width;
+        height = src.height;
+
+        if (255ull * width * height <= UINT32_MAX) {
+            m_wide.reset();
+            _build(src, m_narrow);
+        } else {
+            m_narrow.reset();
+            _build(src, m_wide);
+        }
+    }
+
+    bool wide() const {
+        return bool(m_wide);
+    }
+
+    // Clamps [x0, x1) x [y0, y1) to the image, returns the clamped area
+    int clip(int& x0, int& y0, int& x1, int& y1) const {
+        x0 = std::max(0, std::min(x0, width));
+        x1 = std::max(x0, std::min(x1, width));
+        y0 = std::max(0, std::min(y0, height));
+        y1 = std::max(y0, std::min(y1, height));
+        return (x1 - x0) * (y1 - y0);
+    }
+
+    // Per channel sums over [x0, x1) x [y0, y1), clipped to the image
+    void sums(int x0, int y0, int x1, int y1, uint64_t out[4]) const {
+        clip(x0, y0, x1, y1);
+        if (wide())
+            _sums(m_wide.get(), x0, y0, x1, y1, out);
+        else
+            _sums(m_narrow.get(), x0, y0, x1, y1, out);
+    }
+
+    uint64_t sum(int x0, int y0, int x1, int y1, int channel) const {
+        uint64_t out[4];
+        sums(x0, y0, x1, y1, out);
+        return out[channel];
+    }
+
+    // Per channel means over the clipped rectangle, zero when it is empty
+    void mean(int x0, int y0, int x1, int y1, float out[4]) const {
+        uint64_t total[4];
+        int area = clip(x0, y0, x1, y1);
+        sums(x0, y0, x1, y1, total);
+        for (int c = 0; c < 4; ++c)
+            out[c] = area ? float(total[c]) / area : 0.f;
+    }
+
+#ifdef PIXEL_OPS_SSE2
+    // Low 32 bits of the four channels of an entry. Window sums fit in 32
+    // bits, so differences of the low halves are exact for 64 bit tables too.
+    static __m128i _load_low(uint32_t const* entry) {
+        return _mm_loadu_si128((__m128i const*)entry);
+    }
+
+    static __m128i _load_low(uint64_t const* entry) {
+        __m128 low = _mm_castsi128_ps(_mm_loadu_si128((__m128i const*)entry));
+        __m128 high = _mm_castsi128_ps(_mm_loadu_si128((__m128i const*)(entry + 2)));
+        return _mm_castps_si128(_mm_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0)));
+    }
+
+    // Pixels [x, right) of a local_mean row whose windows are not clipped
+    // horizontally, returns right
+    template<typename T>
+    int _mean_interior(T const* table, int x, int right, int y0, int y1, int radius, png_bytep out) const {
+        __m128 const inverse = _mm_set1_ps(1.f / float((2 * radius + 1) * (y1 - y0))), half = _mm_set1_ps(0.5f);
+        T const* top = &table[_stride() * y0];
+        T const* bottom = &table[_stride() * y1];
+        for (; x < right; ++x) {
+            int x0 = (x - radius) * 4, x1 = (x + radius + 1) * 4;
+            __m128i v = _mm_sub_epi32(_load_low(bottom + x1), _load_low(bottom + x0));
+            v = _mm_add_epi32(v, _mm_sub_epi32(_load_low(top + x0), _load_low(top + x1)));
+            v = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), inverse), half));
+            v = _mm_packs_epi32(v, v);
+            *(int*)(out + x * 4) = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+        }
+        return x;
+    }
+#endif
+
+    // Row y of local_mean. Away from the left and right edges the window
+    // area is the same for the whole row, there every pixel is one SSE2
+    // vector.
+    void mean_row(int y, int radius, png_bytep out) const {
+        int const y0 = std::max(0, y - radius), y1 = std::min(height, y + radius + 1);
+        int const left = std::min(radius, width);
+        auto border = [&](int x) {
+            int x0 = std::max(0, x - radius), x1 = std::min(width, x + radius + 1);
+            float inverse = 1.f / float((x1 - x0) * (y1 - y0));
+            uint64_t total[4];
+            if (wide())
+                _sums(m_wide.get(), x0, y0, x1, y1, total);
+            else
+                _sums(m_narrow.get(), x0, y0, x1, y1, total);
+            for (int c = 0; c < 4; ++c)
+                out[x * 4 + c] = png_byte(int(float(total[c]) * inverse + 0.5f));
+        };
+
+        for (int x = 0; x < left; ++x)
+            border(x);
+        int x = left;
+#ifdef PIXEL_OPS_SSE2
+        // cvtepi32_ps needs the sums below 2^31
+        int const right = std::max(left, width - radius);
+        if (255ll * (2 * radius + 1) * (y1 - y0) <= INT32_MAX)
+            x = wide() ? _mean_interior(m_wide.get(), x, right, y0, y1, radius, out)
+                       : _mean_interior(m_narrow.get(), x, right, y0, y1, radius, out);
+#endif
+        for (; x < width; ++x)
+            border(x);
+    }
+};
+
+// Mean of the (2 * radius + 1)^2 window around every pixel, windows are
+// clipped to the image. Four table lookups per pixel whatever the radius.
+// An empty out is allocated to the table size.
+inline void local_mean(SummedAreaTable const& table, Image& out, int radius) {
+    if (!out.pixels)
+        out.create(table.width, table.height);
+    if (out.width != table.width || out.height != table.height) abort();
+    out.materialize();
+
+    parallel_for(0, table.height, [&](int from, int to) {
+        for (int y = from; y < to; ++y)
+            table.mean_row(y, radius, out.pixels[y]);
+    }, 16);
+}
+
+inline void local_mean(Image const& src, Image& out, int radius) {
+    SummedAreaTable table(src);
+    if (!out.pixels)
+        src.same(out);
+    local_mean(table, out, radius);
+}
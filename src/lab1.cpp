@@ -1,5 +1,21 @@
 #include <algorithm>
+#include <memory>
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <functional>
 #include "png_files.h"
+#include "parallel.h"
+#include "pixel_ops.h"
+#include "image_expr.h"
+#include "convolution.h"
+#include "blur.h"
+#include "integral_image.h"
+#include "resample.h"
+#include "pyramid.h"
+#include "colorspace.h"
+#include "histogram.h"
 
 #define ERROR 0
 #define OK 1
@@ -10,6 +26,111 @@ png_byte default_blend_func(png_byte a, png_byte b, png_byte alpha) {
     return a * (alpha / 255.f) + b * (1.f - alpha / 255.f);
 }
 
+// Blend function tabulated into one 256x256 table per alpha value.
+// Tables are built lazily, only for the alphas actually present in the mask,
+// so an expensive blend_func is evaluated at most 65536 times per alpha.
+class BlendTable {
+private:
+    blend_func_t m_func;
+    std::unique_ptr<png_byte[]> m_tables[256];
+
+    void _build(png_byte alpha) {
+        m_tables[alpha].reset(new png_byte[256 * 256]);
+        png_bytep table = m_tables[alpha].get();
+
+        for (int a = 0; a < 256; ++a)
+            for (int b = 0; b < 256; ++b)
+                table[(a << 8) | b] = m_func(a, b, alpha);
+    }
+public:
+    BlendTable(blend_func_t _func = default_blend_func) : m_func(_func) {}
+
+    // Table indexed by (a << 8) | b for the given alpha
+    png_byte const* get(png_byte alpha) {
+        if (!m_tables[alpha])
+            _build(alpha);
+        return m_tables[alpha].get();
+    }
+
+    // Build tables for every alpha in the mask up front,
+    // after which get() never writes and may be shared between threads
+    void prepare(Image const& mask) {
+        bool present[256] = {};
+        std::vector<png_byte> scratch(size_t(mask.width) * 4);
+        for (int y = 0; y < mask.height; y++) {
+            png_bytep row_mask = mask.row(y, scratch.data());
+            for (int x = 0; x < mask.width; x++)
+                present[row_mask[x * 4 + 3]] = true;
+        }
+
+        for (int alpha = 0; alpha < 256; ++alpha)
+            if (present[alpha] && !m_tables[alpha])
+                _build(alpha);
+    }
+};
+
+bool same_size(Image const& a, Image const& b) {
+    return a.width == b.width && a.height == b.height;
+}
+
+// Output of a pass over src: allocated like src when empty, then stored
+// rows in logical order. false when out has another size.
+bool prepare_out(Image const& src, Image& out) {
+    if (!out.pixels)
+        src.same(out);
+    if (!same_size(src, out))
+        return false;
+    out.materialize();
+    return true;
+}
+
+void blend_row(
+    png_const_bytep row_a,
+    png_const_bytep row_b,
+    png_const_bytep row_mask,
+    png_bytep row_out,
+    int width,
+    blend_func_t blend_func
+){
+    for(int x = 0; x < width; x++) {
+        png_const_bytep px_a = &(row_a[x * 4]);
+        png_const_bytep px_b = &(row_b[x * 4]);
+        png_const_bytep px_mask = &(row_mask[x * 4]);
+        png_bytep px_out = &(row_out[x * 4]);
+
+        for(int i = 0; i < 4; ++i)
+            px_out[i] = blend_func(px_a[i], px_b[i], px_mask[3]);
+    }
+}
+
+// Same as above, but every channel is a lookup into the table
+void blend_row(
+    png_const_bytep row_a,
+    png_const_bytep row_b,
+    png_const_bytep row_mask,
+    png_bytep row_out,
+    int width,
+    BlendTable& table
+){
+    // Masks are mostly runs of one alpha, so keep the last table around
+    int alpha = -1;
+    png_byte const* lut = nullptr;
+
+    for(int x = 0; x < width; x++) {
+        png_const_bytep px_a = &(row_a[x * 4]);
+        png_const_bytep px_b = &(row_b[x * 4]);
+        png_bytep px_out = &(row_out[x * 4]);
+
+        if (row_mask[x * 4 + 3] != alpha) {
+            alpha = row_mask[x * 4 + 3];
+            lut = table.get(alpha);
+        }
+
+        for(int i = 0; i < 4; ++i)
+            px_out[i] = lut[(px_a[i] << 8) | px_b[i]];
+    }
+}
+
 int blend(
     Image const& a,
     Image const& b,
@@ -17,93 +138,444 @@ int blend(
     Image& out,
     blend_func_t blend_func = default_blend_func
 ){
-    if(
-        a.height != b.height ||
-        a.width != b.width ||
-        a.height != mask.height ||
-        a.width != mask.width
-    ) return ERROR;
-    
-    if(!out.pixels)
-        a.same(out);
+    if(!same_size(a, b) || !same_size(a, mask) || !prepare_out(a, out))
+        return ERROR;
+
+    // Inputs are read through their pending orientation
+    std::vector<png_byte> scratch(size_t(a.width) * 4 * 3);
 
     for(int y = 0; y < a.height; y++) {
-        png_bytep row_a = a.pixels[y];
-        png_bytep row_b = b.pixels[y];
-        png_bytep row_mask = mask.pixels[y];
-        png_bytep row_out = out.pixels[y];
-
-        for(int x = 0; x < a.width; x++) {
-            png_bytep px_a = &(row_a[x * 4]);
-            png_bytep px_b = &(row_b[x * 4]);
-            png_bytep px_mask = &(row_mask[x * 4]);
-            png_bytep px_out = &(row_out[x * 4]);
+        png_bytep row_a = a.row(y, &scratch[0]);
+        png_bytep row_b = b.row(y, &scratch[a.width * 4]);
+        png_bytep row_mask = mask.row(y, &scratch[a.width * 8]);
 
-            for(int i = 0; i < 4; ++i)
-                px_out[i] = blend_func(px_a[i], px_b[i], px_mask[3]);
-        }
+        blend_row(row_a, row_b, row_mask, out.pixels[y], a.width, blend_func);
     }
 
     return OK;
 }
 
-int circle_image(
+int blend(
     Image const& a,
-    Image& out
-) {
-    int radius = std::min(a.width, a.height) / 2;
+    Image const& b,
+    Image const& mask,
+    Image& out,
+    BlendTable& table
+){
+    if(!same_size(a, b) || !same_size(a, mask) || !prepare_out(a, out))
+        return ERROR;
 
-    if (!out.pixels)
-        a.same(out);
+    std::vector<png_byte> scratch(size_t(a.width) * 4 * 3);
 
-    int center_w = a.width / 2;
-    int center_h = a.height / 2;
+    for(int y = 0; y < a.height; y++) {
+        png_bytep row_a = a.row(y, &scratch[0]);
+        png_bytep row_b = b.row(y, &scratch[a.width * 4]);
+        png_bytep row_mask = mask.row(y, &scratch[a.width * 8]);
+
+        blend_row(row_a, row_b, row_mask, out.pixels[y], a.width, table);
+    }
 
-    for (int y = 0; y < a.height; y++) {
-        png_bytep row_a = a.pixels[y];
-        png_bytep row_out = out.pixels[y];
+    return OK;
+}
 
-        for (int x = 0; x < a.width; x++) {
-            png_bytep px_a = &(row_a[x * 4]);
+// Shapes for mask_image. Each one is centered at (cx, cy) in pixel space
+// (pixel x covers [x, x + 1)) and provides:
+//   half_width(dy) - half of the covered x-span at vertical offset dy >= 0,
+//                    negative when the row misses the shape
+//   distance(dx, dy) - signed distance to the edge, negative inside
+struct Circle {
+    float cx, cy, r;
+
+    float half_width(float dy) const {
+        return dy > r ? -1.f : std::sqrt(r * r - dy * dy);
+    }
+
+    float distance(float dx, float dy) const {
+        return std::sqrt(dx * dx + dy * dy) - r;
+    }
+};
+
+struct Ellipse {
+    float cx, cy, rx, ry;
+
+    // A zero (or negative) radius has no area and covers no row
+    float half_width(float dy) const {
+        if (rx <= 0.f || ry <= 0.f || dy > ry) return -1.f;
+        return rx * std::sqrt(1.f - (dy / ry) * (dy / ry));
+    }
+
+    // First order approximation, exact enough for one pixel of anti-aliasing
+    float distance(float dx, float dy) const {
+        float k0 = std::sqrt((dx / rx) * (dx / rx) + (dy / ry) * (dy / ry));
+        float k1 = std::sqrt((dx / (rx * rx)) * (dx / (rx * rx)) + (dy / (ry * ry)) * (dy / (ry * ry)));
+        return k1 > 0.f ? k0 * (k0 - 1.f) / k1 : -std::min(rx, ry);
+    }
+};
+
+struct RoundedRect {
+    float cx, cy, hx, hy, r;
+
+    float half_width(float dy) const {
+        if (dy > hy) return -1.f;
+        float corner_dy = dy - (hy - r);
+        if (corner_dy <= 0.f) return hx;
+        return hx - r + std::sqrt(r * r - corner_dy * corner_dy);
+    }
+
+    float distance(float dx, float dy) const {
+        float qx = std::fabs(dx) - (hx - r);
+        float qy = std::fabs(dy) - (hy - r);
+        float ox = std::max(qx, 0.f);
+        float oy = std::max(qy, 0.f);
+        return std::sqrt(ox * ox + oy * oy) + std::min(std::max(qx, qy), 0.f) - r;
+    }
+};
+
+// Copy row y of a width pixels wide image, clearing everything outside
+// shape. The row is split analytically into exterior, edge and interior runs:
+// exterior and interior are plain memset/memcpy, only edge pixels compute
+// coverage, which is stored into alpha for anti-aliasing.
+template<typename Shape>
+void mask_row(
+    png_const_bytep row_a,
+    png_bytep row_out,
+    int width,
+    int y,
+    Shape const& shape
+) {
+    auto clamp_x = [&](float x) {
+        return int(std::min(std::max(x, 0.f), float(width)));
+    };
+
+    float dy = y + 0.5f - shape.cy;
+    float ady = std::fabs(dy);
+
+    auto edge = [&](int from, int to) {
+        for (int x = from; x < to; ++x) {
+            png_const_bytep px_a = &(row_a[x * 4]);
             png_bytep px_out = &(row_out[x * 4]);
 
-            if ((x - center_w) * (x - center_w) + (y - center_h) * (y - center_h) <= radius * radius) {
-                for (int i = 0; i < 4; ++i)
-                    px_out[i] = px_a[i];
-            } else {
-                for (int i = 0; i < 4; ++i)
-                    px_out[i] = 0;
+            float coverage = 0.5f - shape.distance(x + 0.5f - shape.cx, dy);
+            if (coverage <= 0.f) {
+                std::memset(px_out, 0, 4);
+                continue;
             }
+
+            for (int i = 0; i < 3; ++i)
+                px_out[i] = px_a[i];
+            px_out[3] = coverage >= 1.f ? px_a[3] : png_byte(px_a[3] * coverage + 0.5f);
         }
+    };
+
+    // Pixels touching the shape at all, and pixels lying fully inside it
+    float hw_out = shape.half_width(std::max(ady - 0.5f, 0.f));
+    float hw_in = shape.half_width(ady + 0.5f);
+
+    if (hw_out < 0.f) {
+        std::memset(row_out, 0, width * 4);
+        return;
     }
 
+    int out_from = clamp_x(std::floor(shape.cx - hw_out));
+    int out_to = clamp_x(std::ceil(shape.cx + hw_out));
+    int in_from = out_to, in_to = out_to;
+    if (hw_in >= 0.f) {
+        in_from = std::max(clamp_x(std::ceil(shape.cx - hw_in)), out_from);
+        in_to = std::max(std::min(clamp_x(std::floor(shape.cx + hw_in)), out_to), in_from);
+    }
+
+    std::memset(row_out, 0, out_from * 4);
+    edge(out_from, in_from);
+    std::memcpy(row_out + in_from * 4, row_a + in_from * 4, (in_to - in_from) * 4);
+    edge(in_to, out_to);
+    std::memset(row_out + out_to * 4, 0, (width - out_to) * 4);
+}
+
+// Copy a into out, clearing everything outside shape
+template<typename Shape>
+int mask_image(
+    Image const& a,
+    Image& out,
+    Shape const& shape
+) {
+    if (!prepare_out(a, out))
+        return ERROR;
+
+    std::vector<png_byte> scratch(size_t(a.width) * 4);
+
+    for (int y = 0; y < a.height; y++)
+        mask_row(a.row(y, scratch.data()), out.pixels[y], a.width, y, shape);
+
     return OK;
 }
 
+// Largest circle centered in a width x height image
+Circle inscribed_circle(int width, int height) {
+    return {
+        width / 2.f,
+        height / 2.f,
+        std::min(width, height) / 2.f
+    };
+}
+
+int circle_image(
+    Image const& a,
+    Image& out
+) {
+    return mask_image(a, out, inscribed_circle(a.width, a.height));
+}
+
+// Eager flips, for when the pixels themselves have to move.
+// Image::flip_horizontal / flip_vertical only record the flip.
 void horizontal_swap(Image& img){
-    for (int y = 0; y < img.height; ++y) {
-        png_bytep row = img.pixels[y];
-        
-        for (int x = 0; x < (img.width + 1) / 2; ++x) 
-            for(int i = 0; i < 4; ++i)
-                std::swap(row[x * 4 + i], row[(img.width - x - 1) * 4 + i]);
-    }
+    img.materialize();
+
+    parallel_for(0, img.height, [&](int from, int to) {
+        for (int y = from; y < to; ++y)
+            reverse_pixels((uint32_t*)img.pixels[y], img.width);
+    }, 64);
 }
 
+// Rows are separate allocations, so flipping only reorders row pointers
 void vertical_swap(Image& img) {
-    for (int y = 0; y < (img.height + 1) / 2; ++y)
-        for (int x = 0; x < img.width * 4; ++x)
-            std::swap(img.pixels[y][x], img.pixels[img.height - 1 - y][x]);
+    img.materialize();
+    std::reverse(img.pixels, img.pixels + img.height);
 }
 
-int main(){
+// Row-fused chain of lab1 operations over one source image.
+// Stages are declared with the builder methods and run() pushes every row
+// through all of them while it is still in cache, so the frame is read and
+// written once no matter how many stages there are. The result is the same
+// as running the operations one after another.
+class Pipeline {
+private:
+    struct Stage {
+        // Transform one row; y is the row's position in this stage's image
+        std::function<void(png_const_bytep in, png_bytep out, int y, png_bytep scratch)> apply;
+        bool flip_vertical = false;
+    };
+
+    Image const& m_src;
+    std::vector<Stage> m_stages;
+    bool m_valid = true;
+
+    Pipeline& _add(Stage stage) {
+        m_stages.push_back(std::move(stage));
+        return *this;
+    }
+public:
+    Pipeline(Image const& src) : m_src(src) {}
+
+    Pipeline& blend(Image const& b, Image const& mask, blend_func_t blend_func = default_blend_func) {
+        m_valid = m_valid && same_size(m_src, b) && same_size(m_src, mask);
+        int width = m_src.width;
+        return _add({[&b, &mask, blend_func, width](png_const_bytep in, png_bytep out, int y, png_bytep scratch) {
+            blend_row(in, b.row(y, scratch), mask.row(y, scratch + width * 4), out, width, blend_func);
+        }});
+    }
+
+    // The table is filled for all alphas in mask here, so rows can run in parallel
+    Pipeline& blend(Image const& b, Image const& mask, BlendTable& table) {
+        m_valid = m_valid && same_size(m_src, b) && same_size(m_src, mask);
+        table.prepare(mask);
+        int width = m_src.width;
+        return _add({[&b, &mask, &table, width](png_const_bytep in, png_bytep out, int y, png_bytep scratch) {
+            blend_row(in, b.row(y, scratch), mask.row(y, scratch + width * 4), out, width, table);
+        }});
+    }
+
+    template<typename Shape>
+    Pipeline& mask(Shape const& shape) {
+        int width = m_src.width;
+        return _add({[shape, width](png_const_bytep in, png_bytep out, int y, png_bytep) {
+            mask_row(in, out, width, y, shape);
+        }});
+    }
+
+    Pipeline& circle() {
+        return mask(inscribed_circle(m_src.width, m_src.height));
+    }
+
+    Pipeline& flip_horizontal() {
+        int width = m_src.width;
+        return _add({[width](png_const_bytep in, png_bytep out, int, png_bytep) {
+            reverse_copy_pixels((uint32_t*)out, (uint32_t const*)in, width);
+        }});
+    }
+
+    // Only changes which row goes where, rows themselves are untouched
+    Pipeline& flip_vertical() {
+        Stage stage;
+        stage.flip_vertical = true;
+        return _add(std::move(stage));
+    }
+
+    int run(Image& out) const {
+        if (!m_valid || !prepare_out(m_src, out))
+            return ERROR;
+
+        int width = m_src.width, height = m_src.height;
+        size_t row_size = size_t(width) * 4;
+
+        parallel_for(0, height, [&](int from, int to) {
+            // Two ping-pong rows, one row for the source, two for stage inputs
+            std::vector<png_byte> buffers(row_size * 5);
+            png_bytep rows[2] = { &buffers[0], &buffers[row_size] };
+            png_bytep src_scratch = &buffers[row_size * 2];
+            png_bytep stage_scratch = &buffers[row_size * 3];
+
+            for (int y_out = from; y_out < to; ++y_out) {
+                // Walk vertical flips back to find the source row
+                int y = y_out;
+                for (auto const& stage : m_stages)
+                    if (stage.flip_vertical)
+                        y = height - 1 - y;
+
+                png_const_bytep in = m_src.row(y, src_scratch);
+                int current = 0;
+                for (auto const& stage : m_stages) {
+                    if (stage.flip_vertical) {
+                        y = height - 1 - y;
+                        continue;
+                    }
+
+                    stage.apply(in, rows[current], y, stage_scratch);
+                    in = rows[current];
+                    current ^= 1;
+                }
+
+                std::memcpy(out.pixels[y_out], in, row_size);
+            }
+        }, 16);
+
+        return OK;
+    }
+};
+
+// Best of a few runs, reported as bandwidth for `bytes` read and written
+template<typename Func>
+void bench_run(char const* name, size_t bytes, Func func) {
+    double best = 1e30;
+    for (int run = 0; run < 5; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+    printf("%-24s %9.3f ms %8.2f GB/s\n", name, best * 1e3, 2.0 * bytes / best / 1e9);
+}
+
+int bench() {
+    Image img(8000, 6000);
+    size_t bytes = img.row_bytes * img.height;
+
+    for (int y = 0; y < img.height; ++y)
+        for (size_t x = 0; x < img.row_bytes; ++x)
+            img.pixels[y][x] = png_byte(x * 7 + y);
+
+    std::vector<png_byte> copy(bytes);
+    bench_run("memcpy", bytes, [&]() {
+        for (int y = 0; y < img.height; ++y)
+            std::memcpy(copy.data() + y * img.row_bytes, img.pixels[y], img.row_bytes);
+    });
+
+    bench_run("horizontal_swap naive", bytes, [&]() {
+        for (int y = 0; y < img.height; ++y)
+            for (int x = 0; x < (img.width + 1) / 2; ++x)
+                for (int i = 0; i < 4; ++i)
+                    std::swap(img.pixels[y][x * 4 + i], img.pixels[y][(img.width - x - 1) * 4 + i]);
+    });
+    bench_run("horizontal_swap", bytes, [&]() { horizontal_swap(img); });
+
+    bench_run("vertical_swap naive", bytes, [&]() {
+        for (int y = 0; y < img.height / 2; ++y)
+            for (size_t x = 0; x < img.row_bytes; ++x)
+                std::swap(img.pixels[y][x], img.pixels[img.height - 1 - y][x]);
+    });
+    bench_run("vertical_swap", bytes, [&]() { vertical_swap(img); });
+
+    {
+        Image rotated(img.height, img.width);
+        bench_run("rotate90 naive", bytes, [&]() {
+            for (int y = 0; y < rotated.height; ++y)
+                for (int x = 0; x < rotated.width; ++x)
+                    ((uint32_t*)rotated.pixels[y])[x] = ((uint32_t*)img.pixels[img.height - 1 - x])[y];
+        });
+    }
+    bench_run("rotate90", bytes, [&]() { img.rotate90(); img.materialize(); });
+    bench_run("rotate270", bytes, [&]() { img.rotate270(); img.materialize(); });
+    bench_run("transpose", bytes, [&]() { img.transpose(); img.materialize(); });
+
+    {
+        Image out(img.width, img.height);
+        bench_run("convolve sharpen 3x3", bytes, [&]() { convolve(img, out, sharpen_kernel()); });
+        bench_run("convolve binomial 5x5", bytes, [&]() { convolve(img, out, binomial_kernel(2)); });
+        bench_run("convolve box 7x7", bytes, [&]() { convolve(img, out, box_kernel(3)); });
+        bench_run("box_blur r=50", bytes, [&]() { box_blur(img, out, 50); });
+        bench_run("box_gaussian s=50", bytes, [&]() { box_gaussian_blur(img, out, 50); });
+        bench_run("recursive_gaussian s=50", bytes, [&]() { recursive_gaussian_blur(img, out, 50); });
+
+        SummedAreaTable table;
+        bench_run("summed_area_table", bytes, [&]() { table.build(img); });
+        bench_run("local_mean r=50", bytes, [&]() { local_mean(table, out, 50); });
+    }
+
+    {
+        Image out;
+        bench_run("resize 1/4 area", bytes, [&]() { resize(img, out, img.width / 4, img.height / 4, AREA); });
+        bench_run("resize 1/4 lanczos3", bytes, [&]() { resize(img, out, img.width / 4, img.height / 4, LANCZOS3); });
+        bench_run("resize 3/2 bicubic", bytes, [&]() { resize(img, out, img.width * 3 / 2, img.height * 3 / 2, BICUBIC); });
+    }
+
+    {
+        ImagePyramid pyramid;
+        bench_run("pyramid box", bytes, [&]() { pyramid.build(img, PYRAMID_BOX); });
+        bench_run("pyramid tent", bytes, [&]() { pyramid.build(img, PYRAMID_TENT); });
+
+        // A 0 x N source has nothing to halve, it is level 0 alone
+        Image empty(0, 16), level;
+        pyramid.build(empty);
+        pyramid.copy_level(pyramid.level_for(1, 1), level);
+        bool single = pyramid.levels() == 1 && level.width == 0 && level.height == 16;
+        printf("pyramid of 0x16: %s\n", single ? "one level" : "WRONG");
+        if (!single)
+            return 1;
+    }
+
+    {
+        Image out;
+        FloatImage lab;
+        bench_run("to_gray", bytes, [&]() { to_gray(img, out); });
+        bench_run("rgb_to_ycbcr", bytes, [&]() { rgb_to_ycbcr(img, out); });
+        bench_run("rgb_to_hsv", bytes, [&]() { rgb_to_hsv(img, out); });
+        bench_run("rgb_to_lab", bytes, [&]() { rgb_to_lab(img, lab); });
+    }
+
+    {
+        Image out;
+        Histogram counts;
+        bench_run("histogram", bytes, [&]() { histogram(img, counts); });
+        ChannelLut levels = auto_levels_lut(counts);
+        bench_run("apply_lut", bytes, [&]() { apply_lut(img, out, levels); });
+        bench_run("equalize", bytes, [&]() { equalize(img, out); });
+        bench_run("clahe 8x8", bytes, [&]() { clahe(img, out); });
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv){
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        return bench();
+
     Image a("img/capy.png");
     Image b("img/file2.png");
     Image mask("img/file3.png");
     
     {
         Image out;
-        blend(a, b, mask, out);
+        BlendTable table;
+        blend(a, b, mask, out, table);
         out.write_png_file("img/out.png");
     }
 
@@ -113,10 +585,68 @@ int main(){
         out.write_png_file("img/out2.png");
     }
 
-    horizontal_swap(a);
+    {
+        // Same blend as above written as a per-pixel expression
+        Image out;
+        out = lerp(b, a, alpha(mask));
+        out.write_png_file("img/out_expr.png");
+    }
+
+    {
+        // Crop, blend and flip in a single pass over the frame
+        Image out;
+        Pipeline(a).circle().blend(b, mask).flip_horizontal().run(out);
+        out.write_png_file("img/out3.png");
+    }
+
+    {
+        Image out;
+        convolve(a, out, sharpen_kernel());
+        out.write_png_file("img/out_sharpen.png");
+    }
+
+    {
+        // Same blend through a feathered mask
+        Image soft, out;
+        BlendTable table;
+        box_gaussian_blur(mask, soft, 20);
+        blend(a, b, soft, out, table);
+        out.write_png_file("img/out_feather.png");
+    }
+
+    {
+        Image out;
+        resize(a, out, a.width / 4, a.height / 4, AREA);
+        out.write_png_file("img/out_thumb.png");
+    }
+
+    {
+        // Preview from the first mip level that still covers 256 x 256
+        ImagePyramid pyramid(a);
+        Image out;
+        pyramid.copy_level(pyramid.level_for(256, 256), out);
+        out.write_png_file("img/out_preview.png");
+    }
+
+    {
+        Image out;
+        to_gray(a, out);
+        out.write_png_file("img/out_gray.png");
+    }
+
+    {
+        // Local contrast on luma only, so colours keep their hue
+        Image ycc, out;
+        rgb_to_ycbcr(a, ycc);
+        clahe(ycc, ycc, 2.f, 8, 1);
+        ycbcr_to_rgb(ycc, out);
+        out.write_png_file("img/out_clahe.png");
+    }
+
+    a.flip_horizontal();
     a.write_png_file("img/swapped.png");
 
-    vertical_swap(a);
+    a.flip_vertical();
     a.write_png_file("img/swapped2.png");
     
     return 0;
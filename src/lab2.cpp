@@ -1,106 +1,326 @@
-#include "png_files.h"
-#include <vector>
-#include <algorithm>
-#include <cmath>
-
-#define F_P -1
-
-#define RGB 3
-#define RGBA 4
-
-struct Filter{
-private:
-    std::vector<std::vector<int>> m_data;
-    int m_sum = 0;
-
-    int m_px_x = -1;
-    int m_px_y = -1;
-public:
-    Filter(std::vector<std::vector<int>> const& _data) : m_data(_data) {
-        for (int y = 0; y < m_data.size(); ++y) {
-            for (int x = 0; x < m_data[y].size(); ++x) {
-                if (m_data[y][x] != F_P)
-                    m_sum += m_data[y][x];
-                else m_px_x = x, m_px_y = y;
-            }
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+// wingdi.h's RGB(r, g, b) would clash with the channel count of dither.h
+#undef RGB
+#else
+#include <sys/resource.h>
+#endif
+
+#include "dither.h"
+#include "histogram.h"
+#include <chrono>
+#include <string.h>
+#include <string>
+#include <math.h>
+
+// Wall time of error_diffusion on a synthetic frame for 1..N threads
+int bench() {
+    Image src(6000, 4000);
+    for (int y = 0; y < src.height; ++y)
+        for (int x = 0; x < src.width * 4; ++x)
+            src.pixels[y][x] = png_byte((x / 4 + y) ^ (x * 7));
+
+    Image out(src.width, src.height);
+    int cores = std::max(1, int(std::thread::hardware_concurrency()));
+
+    for (int threads = 1; threads <= cores; threads *= 2) {
+        auto start = std::chrono::steady_clock::now();
+        error_diffusion(src, out, 1, FLOYD_STEINBERG, RGB, threads);
+        auto end = std::chrono::steady_clock::now();
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        printf("threads %2d: %8.2f ms %8.2f Mpx/s\n", threads, seconds * 1e3, src.width * src.height / seconds / 1e6);
+    }
+
+    // Threaded runs have to match the sequential scan. A kernel with no
+    // taps left of the pixel leans on the wavefront lag alone.
+    {
+        Filter right_only({
+            { F_P, 1 },
+            { 1, 1 },
+        });
+        Image sequential, threaded;
+        right_only.dither(src, sequential, 1, RGB, 1);
+        right_only.dither(src, threaded, 1, RGB, 4);
+
+        bool identical = true;
+        for (int y = 0; y < src.height && identical; ++y)
+            identical = !memcmp(sequential.pixels[y], threaded.pixels[y], size_t(src.width) * 4);
+        printf("4 threads vs 1, right-only filter: %s\n", identical ? "identical" : "MISMATCH");
+        if (!identical)
+            return 1;
+    }
+
+    Palette palette = kmeans_palette(src, 256);
+    {
+        auto start = std::chrono::steady_clock::now();
+        error_diffusion(src, out, palette, FLOYD_STEINBERG);
+        auto end = std::chrono::steady_clock::now();
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        printf("palette %3d: %8.2f ms %8.2f Mpx/s\n", palette.size(), seconds * 1e3, src.width * src.height / seconds / 1e6);
+    }
+
+    ThresholdMap bayer = bayer_map(3), noise = blue_noise_map();
+    for (ThresholdMap const* map : { &bayer, &noise }) {
+        auto start = std::chrono::steady_clock::now();
+        ordered_dither(src, out, 1, *map);
+        auto end = std::chrono::steady_clock::now();
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        printf("ordered %2dx%-2d: %8.2f ms %8.2f Mpx/s\n", map->width, map->height, seconds * 1e3, src.width * src.height / seconds / 1e6);
+    }
+
+    return 0;
+}
+
+// Peak memory of the whole process so far, in MB
+double peak_memory_mb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize / 1048576.0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+// Luma plane of an image, Rec. 601 weights
+std::vector<float> luma(Image const& img) {
+    std::vector<float> plane(size_t(img.width) * img.height);
+    std::vector<png_byte> scratch(size_t(img.width) * 4);
+    for (int y = 0; y < img.height; ++y) {
+        png_const_bytep row = img.row(y, scratch.data());
+        for (int x = 0; x < img.width; ++x)
+            plane[size_t(y) * img.width + x] = 0.299f * row[x * 4] + 0.587f * row[x * 4 + 1] + 0.114f * row[x * 4 + 2];
+    }
+    return plane;
+}
+
+// Separable Gaussian blur with clamped edges
+std::vector<float> gaussian(std::vector<float> const& plane, int width, int height, float sigma) {
+    int radius = int(ceil(sigma * 3));
+    std::vector<float> weights(radius * 2 + 1);
+    float total = 0;
+    for (int i = -radius; i <= radius; ++i)
+        total += weights[i + radius] = exp(-i * i / (2 * sigma * sigma));
+    for (float& w : weights)
+        w /= total;
+
+    std::vector<float> tmp(plane.size()), out(plane.size());
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            float sum = 0;
+            for (int i = -radius; i <= radius; ++i)
+                sum += weights[i + radius] * plane[size_t(y) * width + std::min(std::max(x + i, 0), width - 1)];
+            tmp[size_t(y) * width + x] = sum;
+        }
+    }
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            float sum = 0;
+            for (int i = -radius; i <= radius; ++i)
+                sum += weights[i + radius] * tmp[size_t(std::min(std::max(y + i, 0), height - 1)) * width + x];
+            out[size_t(y) * width + x] = sum;
         }
-    }   
-
-    void apply(
-        Image& img,
-        int x, int y,
-        int n,
-        int channels = RGB
-    ) const {
-        auto origin_px = &(img.pixels[y][x * 4]);
-        int colors = 1 << n;
-
-        int err_px[4];
-        for (int i = 0; i < channels; ++i) {
-            int new_px = int(std::round(origin_px[i] / 255.f * (colors - 1)) * (255.f / float(colors - 1)));
-            err_px[i] = origin_px[i] - new_px;
-            origin_px[i] = new_px;
+    }
+    return out;
+}
+
+// Mean SSIM of two planes with the usual 11x11 Gaussian window (sigma 1.5)
+double ssim(std::vector<float> const& a, std::vector<float> const& b, int width, int height) {
+    const float C1 = (0.01f * 255) * (0.01f * 255), C2 = (0.03f * 255) * (0.03f * 255);
+
+    std::vector<float> aa(a.size()), bb(a.size()), ab(a.size());
+    for (size_t i = 0; i < a.size(); ++i)
+        aa[i] = a[i] * a[i], bb[i] = b[i] * b[i], ab[i] = a[i] * b[i];
+
+    std::vector<float> mu_a = gaussian(a, width, height, 1.5f), mu_b = gaussian(b, width, height, 1.5f);
+    aa = gaussian(aa, width, height, 1.5f);
+    bb = gaussian(bb, width, height, 1.5f);
+    ab = gaussian(ab, width, height, 1.5f);
+
+    double total = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        float var_a = aa[i] - mu_a[i] * mu_a[i], var_b = bb[i] - mu_b[i] * mu_b[i], cov = ab[i] - mu_a[i] * mu_b[i];
+        total += (2 * mu_a[i] * mu_b[i] + C1) * (2 * cov + C2) / ((mu_a[i] * mu_a[i] + mu_b[i] * mu_b[i] + C1) * (var_a + var_b + C2));
+    }
+    return total / a.size();
+}
+
+struct QualityResult {
+    std::string image;
+    DitherKernel kernel;
+    ScanOrder scan;
+    int n;
+    // High-water mark of the whole process when the row was measured, it
+    // never goes down, so it is not the footprint of that case alone
+    double mpx_per_s, process_peak_mb;
+    double psnr, ssim_blurred, mean_error;
+};
+
+// Synthetic corpus when no images are given: a grey ramp and smooth colour
+void synthetic_corpus(std::vector<std::string>& names, std::vector<Image*>& images) {
+    Image* ramp = new Image(512, 256);
+    Image* waves = new Image(512, 512);
+    for (int y = 0; y < ramp->height; ++y)
+        for (int x = 0; x < ramp->width; ++x) {
+            png_bytep px = &(ramp->pixels[y][x * 4]);
+            px[0] = px[1] = px[2] = png_byte(x / 2);
+            px[3] = 255;
         }
+    for (int y = 0; y < waves->height; ++y)
+        for (int x = 0; x < waves->width; ++x) {
+            png_bytep px = &(waves->pixels[y][x * 4]);
+            px[0] = png_byte(127.5 + 127.5 * sin(x * 0.02 + y * 0.01));
+            px[1] = png_byte(127.5 + 127.5 * sin(y * 0.03));
+            px[2] = png_byte(127.5 + 127.5 * cos((x + y) * 0.015));
+            px[3] = 255;
+        }
+    names = { "ramp", "waves" };
+    images = { ramp, waves };
+}
 
-        for (int f_y = 0; f_y < m_data.size(); ++f_y) {
-            for (int f_x = 0; f_x < m_data[f_y].size(); ++f_x) {
-                int _x = x + f_x - m_px_x;
-                int _y = y + f_y - m_px_y;
-
-                if (
-                    _x < 0 || _x >= img.width ||
-                    _y < 0 || _y >= img.height
-                ) continue;
-
-                if (m_data[f_y][f_x] == F_P) 
-                    continue;
-                
-                auto px = &(img.pixels[_y][_x * 4]);
-                for (int i = 0; i < channels; ++i)
-                    px[i] = std::min(std::max(0, int(px[i]) + int(err_px[i] * (m_data[f_y][f_x] / float(m_sum)))), 255);
+// Every kernel, scan order and bit depth over a corpus of PNG files,
+// written as CSV, or JSON when the output name ends with .json
+int quality(int argc, char** argv) {
+    if (argc < 3) {
+        printf("usage: %s quality <out.csv|out.json> [images...]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> names;
+    std::vector<Image*> images;
+    if (argc > 3) {
+        for (int i = 3; i < argc; ++i) {
+            names.push_back(argv[i]);
+            images.push_back(new Image(argv[i]));
+        }
+    } else synthetic_corpus(names, images);
+
+    std::vector<QualityResult> results;
+    for (size_t image = 0; image < images.size(); ++image) {
+        Image const& src = *images[image];
+        std::vector<float> src_luma = luma(src);
+        std::vector<float> src_blurred = gaussian(src_luma, src.width, src.height, 1.0f);
+        std::vector<png_byte> src_scratch(size_t(src.width) * 4), out_scratch(size_t(src.width) * 4);
+
+        for (int kernel = FLOYD_STEINBERG; kernel <= STEVENSON_ARCE; ++kernel) {
+            for (ScanOrder scan : { RASTER, SERPENTINE }) {
+                for (int n = 1; n <= 8; ++n) {
+                    Image out;
+
+                    // Best of three runs
+                    double seconds = 1e30;
+                    for (int run = 0; run < 3; ++run) {
+                        auto start = std::chrono::steady_clock::now();
+                        error_diffusion(src, out, n, DitherKernel(kernel), RGB, 1, scan);
+                        auto end = std::chrono::steady_clock::now();
+                        seconds = std::min(seconds, std::chrono::duration<double>(end - start).count());
+                    }
+
+                    double squared = 0, signed_error = 0;
+                    for (int y = 0; y < src.height; ++y) {
+                        png_const_bytep row_src = src.row(y, src_scratch.data());
+                        png_const_bytep row_out = out.row(y, out_scratch.data());
+                        for (int x = 0; x < src.width * 4; ++x) {
+                            if ((x & 3) == 3)
+                                continue;
+                            int d = row_out[x] - row_src[x];
+                            squared += d * d;
+                            signed_error += d;
+                        }
+                    }
+                    double samples = 3.0 * src.width * src.height;
+                    double mse = squared / samples;
+
+                    QualityResult result;
+                    result.image = names[image];
+                    result.kernel = DitherKernel(kernel);
+                    result.scan = scan;
+                    result.n = n;
+                    result.mpx_per_s = src.width * src.height / seconds / 1e6;
+                    result.process_peak_mb = peak_memory_mb();
+                    result.psnr = mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : INFINITY;
+                    result.ssim_blurred = ssim(src_blurred, gaussian(luma(out), src.width, src.height, 1.0f), src.width, src.height);
+                    result.mean_error = signed_error / samples;
+                    results.push_back(result);
+                }
             }
         }
     }
-};
 
-Filter default_filter(
-    { 
-        {0, F_P, 7} ,
-        {3, 5, 1}
+    for (Image* image : images)
+        delete image;
+
+    FILE* fp = fopen(argv[2], "w");
+    if (!fp) abort();
+
+    size_t name_length = strlen(argv[2]);
+    bool json = name_length >= 5 && !strcmp(argv[2] + name_length - 5, ".json");
+    if (json) fprintf(fp, "[\n");
+    else fprintf(fp, "image,kernel,scan,bits,mpx_per_s,process_peak_mb,psnr,ssim_blurred,mean_error\n");
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        QualityResult const& r = results[i];
+        char const* scan = r.scan == SERPENTINE ? "serpentine" : "raster";
+        // PSNR of a lossless result (n = 8) is infinite, not valid JSON
+        double psnr = std::isinf(r.psnr) ? 999 : r.psnr;
+        if (json) fprintf(
+            fp,
+            "  {\"image\": \"%s\", \"kernel\": \"%s\", \"scan\": \"%s\", \"bits\": %d, \"mpx_per_s\": %.2f, \"process_peak_mb\": %.1f, \"psnr\": %.3f, \"ssim_blurred\": %.5f, \"mean_error\": %.4f}%s\n",
+            r.image.c_str(), kernel_name(r.kernel), scan, r.n, r.mpx_per_s, r.process_peak_mb, psnr, r.ssim_blurred, r.mean_error,
+            i + 1 < results.size() ? "," : ""
+        );
+        else fprintf(
+            fp,
+            "%s,%s,%s,%d,%.2f,%.1f,%.3f,%.5f,%.4f\n",
+            r.image.c_str(), kernel_name(r.kernel), scan, r.n, r.mpx_per_s, r.process_peak_mb, psnr, r.ssim_blurred, r.mean_error
+        );
     }
-);
-
-void FloydStainberg(
-    Image& img,
-    int n,
-    Filter filter = default_filter,
-    int channels = RGB
-) {
-    for (int y = 0; y < img.height; y++) 
-        for (int x = 0; x < img.width; x++) 
-            filter.apply(img, x, y, n);
+
+    if (json) fprintf(fp, "]\n");
+    fclose(fp);
+    return 0;
 }
 
-int main(){
+int main(int argc, char** argv){
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        return bench();
+    if (argc > 1 && !strcmp(argv[1], "quality"))
+        return quality(argc, argv);
+
     {
         Image a("img/eifel.png");
-        FloydStainberg(a, 1);
-        a.write_png_file("img/eifel_1.png");
+        dither_multi(a, { 1, 2, 4, 8 }, [](int n, Image const& out) {
+            std::string filename = "img/eifel_" + std::to_string(n) + ".png";
+            out.write_png_file(filename.c_str());
+        });
     }
     {
         Image a("img/eifel.png");
-        FloydStainberg(a, 2);
-        a.write_png_file("img/eifel_2.png");
+        linear_error_diffusion(a, a, 1, FLOYD_STEINBERG);
+        a.write_png_file("img/eifel_linear_1.png");
     }
     {
         Image a("img/eifel.png");
-        FloydStainberg(a, 4);
-        a.write_png_file("img/eifel_4.png");
+        Palette palette = kmeans_palette(a, 16);
+        error_diffusion(a, a, palette, FLOYD_STEINBERG);
+        a.write_png_file("img/eifel_palette.png");
     }
     {
+        // Stretching the levels first spends the two output levels on the
+        // range the image actually uses
         Image a("img/eifel.png");
-        FloydStainberg(a, 8);
-        a.write_png_file("img/eifel_8.png");
+        auto_levels(a, a);
+        error_diffusion(a, a, 1, FLOYD_STEINBERG);
+        a.write_png_file("img/eifel_levels_1.png");
     }
 
 
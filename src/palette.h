@@ -0,0 +1,326 @@
+#pragma once
+#include "png_files.h"
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+// Colour palettes for quantization: fixed ones, or generated from an image
+// by median cut, octree reduction or k-means.
+
+const int MAX_PALETTE = 256;
+
+// Nearest colours are looked up in a grid of 32 x 32 x 32 cells. Each cell
+// lists every palette colour that can be the nearest one for some point
+// inside it, so a lookup compares against a handful of colours only.
+const int GRID_BITS = 5;
+const int GRID_SIZE = 1 << GRID_BITS;
+const int GRID_SHIFT = 8 - GRID_BITS;
+
+inline int grid_cell(int r, int g, int b) {
+    return (((r >> GRID_SHIFT) << GRID_BITS | (g >> GRID_SHIFT)) << GRID_BITS) | (b >> GRID_SHIFT);
+}
+
+class Palette {
+private:
+    std::vector<png_color> m_colors;
+    std::vector<int> m_cell_start;
+    std::vector<png_byte> m_candidates;
+
+    // Squared distance from c to the nearest and the farthest point of a cell
+    static void _cell_distance(png_color const& c, int const lo[3], int& near, int& far) {
+        int channel[3] = { c.red, c.green, c.blue };
+        near = far = 0;
+        for (int i = 0; i < 3; ++i) {
+            int hi = lo[i] + (1 << GRID_SHIFT) - 1;
+            int d_near = channel[i] < lo[i] ? lo[i] - channel[i] : (channel[i] > hi ? channel[i] - hi : 0);
+            int d_far = std::max(channel[i] - lo[i], hi - channel[i]);
+            near += d_near * d_near;
+            far += d_far * d_far;
+        }
+    }
+
+    void _build_grid() {
+        int cells = GRID_SIZE * GRID_SIZE * GRID_SIZE;
+        m_cell_start.assign(cells + 1, 0);
+        m_candidates.clear();
+
+        std::vector<int> near(m_colors.size()), far(m_colors.size());
+        for (int cell = 0; cell < cells; ++cell) {
+            int lo[3] = {
+                (cell >> (2 * GRID_BITS)) << GRID_SHIFT,
+                ((cell >> GRID_BITS) & (GRID_SIZE - 1)) << GRID_SHIFT,
+                (cell & (GRID_SIZE - 1)) << GRID_SHIFT,
+            };
+
+            // No point of the cell is farther than bound from its best colour
+            int bound = INT32_MAX;
+            for (size_t c = 0; c < m_colors.size(); ++c) {
+                _cell_distance(m_colors[c], lo, near[c], far[c]);
+                bound = std::min(bound, far[c]);
+            }
+
+            m_cell_start[cell] = int(m_candidates.size());
+            for (size_t c = 0; c < m_colors.size(); ++c)
+                if (near[c] <= bound)
+                    m_candidates.push_back(png_byte(c));
+        }
+        m_cell_start[cells] = int(m_candidates.size());
+    }
+public:
+    Palette(std::vector<png_color> const& _colors) : m_colors(_colors) {
+        if (m_colors.empty() || m_colors.size() > MAX_PALETTE) abort();
+        _build_grid();
+    }
+
+    int size() const { return int(m_colors.size()); }
+    png_color const& operator[](int i) const { return m_colors[i]; }
+    std::vector<png_color> const& colors() const { return m_colors; }
+
+    // Index of the closest colour (squared RGB distance, lowest index on ties)
+    int nearest(int r, int g, int b) const {
+        int cell = grid_cell(r, g, b);
+        png_byte const* candidate = &m_candidates[m_cell_start[cell]];
+        png_byte const* end = &m_candidates[0] + m_cell_start[cell + 1];
+        png_color const* colors = m_colors.data();
+
+        int best = *candidate, best_distance = INT32_MAX;
+        for (; candidate != end; ++candidate) {
+            png_color const& c = colors[*candidate];
+            int dr = r - c.red, dg = g - c.green, db = b - c.blue;
+            int distance = dr * dr + dg * dg + db * db;
+            if (distance < best_distance)
+                best_distance = distance, best = *candidate;
+        }
+        return best;
+    }
+
+    // Same result as nearest(), by comparing against every colour
+    int nearest_reference(int r, int g, int b) const {
+        int best = 0, best_distance = INT32_MAX;
+        for (int i = 0; i < size(); ++i) {
+            int dr = r - m_colors[i].red, dg = g - m_colors[i].green, db = b - m_colors[i].blue;
+            int distance = dr * dr + dg * dg + db * db;
+            if (distance < best_distance)
+                best_distance = distance, best = i;
+        }
+        return best;
+    }
+};
+
+// Image colours binned to 5 bits per channel. Bins keep the exact sums of
+// their pixels, so palette colours are true means rather than bin centres.
+struct ColorBin {
+    int key[3];
+    uint64_t count;
+    uint64_t sum[3];
+
+    png_color mean() const {
+        png_color c;
+        c.red = png_byte((sum[0] + count / 2) / count);
+        c.green = png_byte((sum[1] + count / 2) / count);
+        c.blue = png_byte((sum[2] + count / 2) / count);
+        return c;
+    }
+};
+
+inline std::vector<ColorBin> color_bins(Image const& img) {
+    int cells = GRID_SIZE * GRID_SIZE * GRID_SIZE;
+    std::vector<ColorBin> bins(cells, ColorBin{ {0, 0, 0}, 0, {0, 0, 0} });
+    std::vector<png_byte> scratch(size_t(img.width) * 4);
+
+    for (int y = 0; y < img.height; ++y) {
+        png_const_bytep row = img.row(y, scratch.data());
+        for (int x = 0; x < img.width; ++x) {
+            png_const_bytep px = &(row[x * 4]);
+            ColorBin& bin = bins[grid_cell(px[0], px[1], px[2])];
+            bin.count++;
+            for (int i = 0; i < 3; ++i)
+                bin.sum[i] += px[i];
+        }
+    }
+
+    std::vector<ColorBin> used;
+    for (int cell = 0; cell < cells; ++cell) {
+        if (!bins[cell].count)
+            continue;
+        bins[cell].key[0] = cell >> (2 * GRID_BITS);
+        bins[cell].key[1] = (cell >> GRID_BITS) & (GRID_SIZE - 1);
+        bins[cell].key[2] = cell & (GRID_SIZE - 1);
+        used.push_back(bins[cell]);
+    }
+    return used;
+}
+
+inline ColorBin merge_bins(ColorBin const* begin, ColorBin const* end) {
+    ColorBin total = { {0, 0, 0}, 0, {0, 0, 0} };
+    for (ColorBin const* bin = begin; bin != end; ++bin) {
+        total.count += bin->count;
+        for (int i = 0; i < 3; ++i)
+            total.sum[i] += bin->sum[i];
+    }
+    return total;
+}
+
+// Median cut: repeatedly split the box with the widest channel range at the
+// pixel median of that channel
+inline Palette median_cut_palette(Image const& img, int count) {
+    std::vector<ColorBin> bins = color_bins(img);
+    if (bins.empty() || count < 1 || count > MAX_PALETTE) abort();
+
+    struct Box { int begin, end, axis, range; };
+    auto make_box = [&](int begin, int end) {
+        Box box = { begin, end, 0, -1 };
+        for (int i = 0; i < 3; ++i) {
+            int lo = GRID_SIZE, hi = -1;
+            for (int b = begin; b < end; ++b)
+                lo = std::min(lo, bins[b].key[i]), hi = std::max(hi, bins[b].key[i]);
+            if (hi - lo > box.range)
+                box.range = hi - lo, box.axis = i;
+        }
+        return box;
+    };
+
+    std::vector<Box> boxes = { make_box(0, int(bins.size())) };
+    while (int(boxes.size()) < count) {
+        int widest = -1;
+        for (int b = 0; b < int(boxes.size()); ++b)
+            if (boxes[b].range > 0 && (widest < 0 || boxes[b].range > boxes[widest].range))
+                widest = b;
+        if (widest < 0)
+            break;
+
+        Box box = boxes[widest];
+        std::sort(bins.begin() + box.begin, bins.begin() + box.end, [&](ColorBin const& a, ColorBin const& b) {
+            return a.key[box.axis] < b.key[box.axis];
+        });
+
+        uint64_t half = merge_bins(&bins[box.begin], &bins[0] + box.end).count / 2;
+        uint64_t seen = 0;
+        int split = box.begin + 1;
+        for (int b = box.begin; b < box.end - 1; ++b) {
+            seen += bins[b].count;
+            split = b + 1;
+            if (seen >= half)
+                break;
+        }
+
+        boxes[widest] = make_box(box.begin, split);
+        boxes.push_back(make_box(split, box.end));
+    }
+
+    std::vector<png_color> colors;
+    for (Box const& box : boxes)
+        colors.push_back(merge_bins(&bins[box.begin], &bins[0] + box.end).mean());
+    return Palette(colors);
+}
+
+// Octree reduction over the colour bins: leaves are merged into their
+// parent, deepest and least used first, until at most count remain
+inline Palette octree_palette(Image const& img, int count) {
+    std::vector<ColorBin> bins = color_bins(img);
+    if (bins.empty() || count < 1 || count > MAX_PALETTE) abort();
+
+    struct Node {
+        int child[8];
+        ColorBin total;
+        bool leaf;
+    };
+    std::vector<Node> nodes(1, Node{ {-1, -1, -1, -1, -1, -1, -1, -1}, { {0, 0, 0}, 0, {0, 0, 0} }, false });
+    std::vector<std::vector<int>> levels(GRID_BITS);
+
+    for (ColorBin const& bin : bins) {
+        int node = 0;
+        for (int level = 0; level < GRID_BITS; ++level) {
+            int bit = GRID_BITS - 1 - level;
+            int octant = ((bin.key[0] >> bit) & 1) << 2 | ((bin.key[1] >> bit) & 1) << 1 | ((bin.key[2] >> bit) & 1);
+            if (nodes[node].child[octant] < 0) {
+                nodes[node].child[octant] = int(nodes.size());
+                nodes.push_back(Node{ {-1, -1, -1, -1, -1, -1, -1, -1}, { {0, 0, 0}, 0, {0, 0, 0} }, level + 1 == GRID_BITS });
+                if (level + 1 < GRID_BITS)
+                    levels[level + 1].push_back(nodes[node].child[octant]);
+            }
+            node = nodes[node].child[octant];
+            nodes[node].total.count += bin.count;
+            for (int i = 0; i < 3; ++i)
+                nodes[node].total.sum[i] += bin.sum[i];
+        }
+    }
+    levels[0].push_back(0);
+
+    int leaves = int(bins.size());
+    for (int level = GRID_BITS - 1; level >= 0 && leaves > count; --level) {
+        std::vector<int>& reducible = levels[level];
+        std::sort(reducible.begin(), reducible.end(), [&](int a, int b) {
+            return nodes[a].total.count > nodes[b].total.count;
+        });
+
+        while (!reducible.empty() && leaves > count) {
+            Node& node = nodes[reducible.back()];
+            reducible.pop_back();
+
+            int children = 0;
+            for (int& child : node.child) {
+                if (child >= 0)
+                    ++children, child = -1;
+            }
+            node.leaf = true;
+            leaves -= children - 1;
+        }
+    }
+
+    // The root keeps no sums of its own
+    if (nodes[0].leaf)
+        nodes[0].total = merge_bins(&bins[0], &bins[0] + bins.size());
+
+    std::vector<png_color> colors;
+    std::vector<int> stack = { 0 };
+    while (!stack.empty()) {
+        Node const& node = nodes[stack.back()];
+        stack.pop_back();
+        if (node.leaf) {
+            colors.push_back(node.total.mean());
+            continue;
+        }
+        for (int child : node.child)
+            if (child >= 0)
+                stack.push_back(child);
+    }
+    return Palette(colors);
+}
+
+// K-means (Lloyd) refinement of a median cut palette, weighting every bin
+// by its pixel count
+inline Palette kmeans_palette(Image const& img, int count, int iterations = 8) {
+    std::vector<ColorBin> bins = color_bins(img);
+    std::vector<png_color> colors = median_cut_palette(img, count).colors();
+    std::vector<png_color> points;
+    for (ColorBin const& bin : bins)
+        points.push_back(bin.mean());
+
+    std::vector<int> cluster(bins.size(), -1);
+    for (int iteration = 0; iteration < iterations; ++iteration) {
+        Palette palette(colors);
+
+        bool changed = false;
+        for (size_t b = 0; b < bins.size(); ++b) {
+            int nearest = palette.nearest(points[b].red, points[b].green, points[b].blue);
+            changed |= nearest != cluster[b];
+            cluster[b] = nearest;
+        }
+        if (!changed)
+            break;
+
+        std::vector<ColorBin> totals(colors.size(), ColorBin{ {0, 0, 0}, 0, {0, 0, 0} });
+        for (size_t b = 0; b < bins.size(); ++b) {
+            totals[cluster[b]].count += bins[b].count;
+            for (int i = 0; i < 3; ++i)
+                totals[cluster[b]].sum[i] += bins[b].sum[i];
+        }
+
+        // Empty clusters keep their colour
+        for (size_t c = 0; c < colors.size(); ++c)
+            if (totals[c].count)
+                colors[c] = totals[c].mean();
+    }
+    return Palette(colors);
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+// Split [begin, end) into one contiguous chunk per hardware thread and call
+// func(from, to) for every chunk. Chunks are never smaller than min_chunk,
+// so small ranges run inline on the calling thread.
+template<typename Func>
+void parallel_for(int begin, int end, Func func, int min_chunk = 1) {
+    int count = end - begin;
+    if (count <= 0)
+        return;
+
+    int threads = std::max(1, int(std::thread::hardware_concurrency()));
+    threads = std::min(threads, std::max(1, count / std::max(1, min_chunk)));
+
+    if (threads == 1) {
+        func(begin, end);
+        return;
+    }
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (int t = 1; t < threads; ++t)
+        pool.emplace_back(func, begin + int((long long)count * t / threads), begin + int((long long)count * (t + 1) / threads));
+
+    func(begin, begin + count / threads);
+
+    for (auto& thread : pool)
+        thread.join();
+}
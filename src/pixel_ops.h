@@ -0,0 +1,93 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PIXEL_OPS_SSE2 1
+#endif
+
+// Low level kernels over rows of 32-bit RGBA pixels
+
+// Reverse the pixel order of a row in place
+inline void reverse_pixels(uint32_t* row, int width) {
+    int i = 0, j = width;
+
+#ifdef PIXEL_OPS_SSE2
+    for (; j - i >= 8; i += 4, j -= 4) {
+        __m128i left = _mm_loadu_si128((__m128i const*)(row + i));
+        __m128i right = _mm_loadu_si128((__m128i const*)(row + j - 4));
+        _mm_storeu_si128((__m128i*)(row + i), _mm_shuffle_epi32(right, _MM_SHUFFLE(0, 1, 2, 3)));
+        _mm_storeu_si128((__m128i*)(row + j - 4), _mm_shuffle_epi32(left, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+#endif
+
+    for (; j - i >= 2; ++i, --j)
+        std::swap(row[i], row[j - 1]);
+}
+
+// dst[x] = src[width - 1 - x], dst and src must not overlap
+inline void reverse_copy_pixels(uint32_t* dst, uint32_t const* src, int width) {
+    int x = 0;
+
+#ifdef PIXEL_OPS_SSE2
+    for (; x + 4 <= width; x += 4) {
+        __m128i px = _mm_loadu_si128((__m128i const*)(src + width - x - 4));
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_shuffle_epi32(px, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+#endif
+
+    for (; x < width; ++x)
+        dst[x] = src[width - 1 - x];
+}
+
+#ifdef PIXEL_OPS_SSE2
+// 4x4 block transpose: dst[r][c] = src[c][r]
+inline void transpose_block4(uint32_t* const* dst, uint32_t const* const* src, int dst_x, int dst_y) {
+    __m128i r0 = _mm_loadu_si128((__m128i const*)(src[dst_x + 0] + dst_y));
+    __m128i r1 = _mm_loadu_si128((__m128i const*)(src[dst_x + 1] + dst_y));
+    __m128i r2 = _mm_loadu_si128((__m128i const*)(src[dst_x + 2] + dst_y));
+    __m128i r3 = _mm_loadu_si128((__m128i const*)(src[dst_x + 3] + dst_y));
+
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+    _mm_storeu_si128((__m128i*)(dst[dst_y + 0] + dst_x), _mm_unpacklo_epi64(t0, t1));
+    _mm_storeu_si128((__m128i*)(dst[dst_y + 1] + dst_x), _mm_unpackhi_epi64(t0, t1));
+    _mm_storeu_si128((__m128i*)(dst[dst_y + 2] + dst_x), _mm_unpacklo_epi64(t2, t3));
+    _mm_storeu_si128((__m128i*)(dst[dst_y + 3] + dst_x), _mm_unpackhi_epi64(t2, t3));
+}
+#endif
+
+const int TRANSPOSE_TILE = 32;
+
+// dst[y][x] = src[x][y] for dst rows [y_from, y_to) of width pixels.
+// Works tile by tile so both sides stay in cache; rows are passed as pointer
+// arrays, so mirrored transposes only need reordered pointers.
+inline void transpose_pixels(uint32_t* const* dst, uint32_t const* const* src, int width, int y_from, int y_to) {
+    for (int tile_y = y_from; tile_y < y_to; tile_y += TRANSPOSE_TILE) {
+        int tile_y_end = std::min(tile_y + TRANSPOSE_TILE, y_to);
+
+        for (int tile_x = 0; tile_x < width; tile_x += TRANSPOSE_TILE) {
+            int tile_x_end = std::min(tile_x + TRANSPOSE_TILE, width);
+            int y = tile_y;
+
+#ifdef PIXEL_OPS_SSE2
+            for (; y + 4 <= tile_y_end; y += 4) {
+                int x = tile_x;
+                for (; x + 4 <= tile_x_end; x += 4)
+                    transpose_block4(dst, src, x, y);
+                for (; x < tile_x_end; ++x)
+                    for (int i = 0; i < 4; ++i)
+                        dst[y + i][x] = src[x][y + i];
+            }
+#endif
+
+            for (; y < tile_y_end; ++y)
+                for (int x = tile_x; x < tile_x_end; ++x)
+                    dst[y][x] = src[x][y];
+        }
+    }
+}
@@ -2,10 +2,24 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <memory>
+#include <vector>
+#include <string.h>
 #include <png.h>
+#include "parallel.h"
+#include "pixel_ops.h"
 
 using image_t = png_bytep*;
 
+// Pending orientation of an Image, any combination of the flags below gives
+// one of the 8 EXIF orientations. Logical pixel (x, y) is found in storage by
+// first mirroring x and/or y, then swapping the coordinates if transposed.
+enum Orientation : png_byte {
+	ORIENT_IDENTITY = 0,
+	ORIENT_FLIP_X = 1,
+	ORIENT_FLIP_Y = 2,
+	ORIENT_TRANSPOSE = 4,
+};
+
 class Image {
 private:
 
@@ -14,12 +28,24 @@ private:
 		for(int y = 0; y < height; y++)
 			pixels[y] = (png_byte*)malloc(row_bytes);
 	}
+
+	void _free_pixels(){
+		if (pixels) {
+			for (int y = 0; y < stored_height(); y++)
+				free(pixels[y]);
+			free(pixels);
+			pixels = nullptr;
+		}
+	}
 public:
+	// width and height are always the logical (oriented) size,
+	// pixels and row_bytes describe the storage
     int width, height;
     png_byte color_type;
     png_byte bit_depth;
     image_t pixels = nullptr;
 	size_t row_bytes;
+	png_byte orientation = ORIENT_IDENTITY;
 
 	// Create copy of this image with other pixel buffer
 	void same(Image& other) const {
@@ -27,13 +53,140 @@ public:
 		other.height = height;
 		other.color_type = color_type;
 		other.bit_depth = bit_depth;
-		other.row_bytes = row_bytes;
+		other.row_bytes = size_t(width) * 4;
+		other.orientation = ORIENT_IDENTITY;
 
 		other._allocate_pixels();
 	}
 
+	// out = expression, see image_expr.h
+	template<typename E, typename = typename E::is_image_expr>
+	Image& operator=(E const& expr) {
+		evaluate(*this, expr);
+		return *this;
+	}
+
+	int stored_width() const {
+		return orientation & ORIENT_TRANSPOSE ? height : width;
+	}
+
+	int stored_height() const {
+		return orientation & ORIENT_TRANSPOSE ? width : height;
+	}
+
+	// O(1) orientation changes, pixels are only moved by materialize()
+	void flip_horizontal() {
+		orientation ^= ORIENT_FLIP_X;
+	}
+
+	void flip_vertical() {
+		orientation ^= ORIENT_FLIP_Y;
+	}
+
+	void rotate180() {
+		orientation ^= ORIENT_FLIP_X | ORIENT_FLIP_Y;
+	}
+
+	void transpose() {
+		png_byte flip_x = orientation & ORIENT_FLIP_X;
+		png_byte flip_y = orientation & ORIENT_FLIP_Y;
+		orientation = ((orientation & ORIENT_TRANSPOSE) ^ ORIENT_TRANSPOSE) | (flip_x << 1) | (flip_y >> 1);
+		std::swap(width, height);
+	}
+
+	// Clockwise
+	void rotate90() {
+		transpose();
+		flip_horizontal();
+	}
+
+	void rotate270() {
+		transpose();
+		flip_vertical();
+	}
+
+	// Logical row y. Returns the stored row when no pixel reordering is
+	// needed, otherwise gathers it into scratch (width * 4 bytes).
+	png_bytep row(int y, png_bytep scratch) const {
+		if (!(orientation & ORIENT_TRANSPOSE)) {
+			png_bytep stored = pixels[orientation & ORIENT_FLIP_Y ? height - 1 - y : y];
+			if (!(orientation & ORIENT_FLIP_X))
+				return stored;
+
+			reverse_copy_pixels((uint32_t*)scratch, (uint32_t const*)stored, width);
+			return scratch;
+		}
+
+		int column = orientation & ORIENT_FLIP_Y ? height - 1 - y : y;
+		uint32_t* out = (uint32_t*)scratch;
+		for (int x = 0; x < width; ++x)
+			out[x] = ((uint32_t const*)pixels[orientation & ORIENT_FLIP_X ? width - 1 - x : x])[column];
+		return scratch;
+	}
+
+	// Apply the pending orientation to the stored pixels
+	void materialize() {
+		if (orientation == ORIENT_IDENTITY)
+			return;
+
+		if (orientation & ORIENT_TRANSPOSE) {
+			image_t transposed = (png_bytep*)malloc(sizeof(png_bytep) * height);
+			for (int y = 0; y < height; y++)
+				transposed[y] = (png_byte*)malloc(size_t(width) * 4);
+
+			// Mirroring is folded into the transpose by reordering row pointers
+			std::vector<uint32_t const*> src(width);
+			for (int x = 0; x < width; x++)
+				src[x] = (uint32_t const*)pixels[orientation & ORIENT_FLIP_X ? width - 1 - x : x];
+
+			std::vector<uint32_t*> dst(height);
+			for (int y = 0; y < height; y++)
+				dst[y] = (uint32_t*)transposed[orientation & ORIENT_FLIP_Y ? height - 1 - y : y];
+
+			int tiles = (height + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+			parallel_for(0, tiles, [&](int from, int to) {
+				transpose_pixels(dst.data(), src.data(), width, from * TRANSPOSE_TILE, std::min(to * TRANSPOSE_TILE, height));
+			});
+
+			_free_pixels();
+			pixels = transposed;
+			row_bytes = size_t(width) * 4;
+			orientation = ORIENT_IDENTITY;
+			return;
+		}
+
+		if (orientation & ORIENT_FLIP_Y)
+			std::reverse(pixels, pixels + height);
+
+		if (orientation & ORIENT_FLIP_X)
+			parallel_for(0, height, [&](int from, int to) {
+				for (int y = from; y < to; ++y)
+					reverse_pixels((uint32_t*)pixels[y], width);
+			}, 64);
+
+		orientation = ORIENT_IDENTITY;
+	}
+
 	Image() {};
 
+	// Blank RGBA image
+	Image(int _width, int _height) {
+		create(_width, _height);
+	}
+
+	void create(int _width, int _height) {
+		_free_pixels();
+
+		width = _width;
+		height = _height;
+		color_type = PNG_COLOR_TYPE_RGBA;
+		bit_depth = 8;
+		row_bytes = size_t(width) * 4;
+		orientation = ORIENT_IDENTITY;
+
+		_allocate_pixels();
+	}
+
     Image(const char* filename){
 		read_png_file(filename);
     }
@@ -98,7 +251,7 @@ public:
 		png_destroy_read_struct(&png, &info, (png_infopp)NULL);
 	}
 
-	void write_png_file(char *filename) const {
+	void write_png_file(const char* filename) const {
 		FILE *fp = fopen(filename, "wb");
 		if(!fp) abort();
 
@@ -130,7 +283,11 @@ public:
 
 		if (!pixels) abort();
 
-		png_write_image(png, pixels);
+		// Rows are streamed through the pending orientation
+		png_bytep scratch = (png_byte*)malloc(size_t(width) * 4);
+		for (int y = 0; y < height; y++)
+			png_write_row(png, row(y, scratch));
+		free(scratch);
 		png_write_end(png, NULL);
 
 		fclose(fp);
@@ -139,11 +296,7 @@ public:
 	}
 
     ~Image(){
-		if (pixels) {
-			for (int y = 0; y < height; y++)
-				free(pixels[y]);
-			free(pixels);
-		}
+		_free_pixels();
     }
 };
 
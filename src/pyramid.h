@@ -0,0 +1,252 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <stdint.h>
+#include "png_files.h"
+#include "parallel.h"
+#include "pixel_ops.h"
+
+// Image pyramid: level 0 is the source, every next level is half the size
+// of the one above (rounded up, the last row and column repeat) down to
+// 1 x 1. All levels live in one allocation, rows packed without padding.
+//
+//     PYRAMID_BOX  - mean of 2 x 2 pixels, the usual mipmap
+//     PYRAMID_TENT - [1 2 1] x [1 2 1] / 16 around every even pixel
+//
+// Levels are built while the source streams in: as soon as a level has
+// the rows that the next row below needs, that row is made, so all levels
+// come out of one pass with the rows still in cache.
+
+enum PyramidFilter {
+    PYRAMID_BOX,
+    PYRAMID_TENT,
+};
+
+// out[x] = mean of a[2x], a[2x + 1], b[2x], b[2x + 1], the last pixel of
+// odd rows paired with itself. With SSE2 four output pixels at a time:
+// even and odd input pixels are split by one shuffle each.
+inline void reduce_box_row(png_const_bytep a, png_const_bytep b, png_bytep out, int width, int out_width) {
+    int x = 0;
+
+#ifdef PIXEL_OPS_SSE2
+    __m128i const zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+    auto split = [](png_const_bytep row, __m128i& even, __m128i& odd) {
+        __m128 lo = _mm_castsi128_ps(_mm_loadu_si128((__m128i const*)row));
+        __m128 hi = _mm_castsi128_ps(_mm_loadu_si128((__m128i const*)(row + 16)));
+        even = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+        odd = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+    };
+    for (; 2 * x + 8 <= width; x += 4) {
+        __m128i a_even, a_odd, b_even, b_odd;
+        split(a + x * 8, a_even, a_odd);
+        split(b + x * 8, b_even, b_odd);
+
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a_even, zero), _mm_unpacklo_epi8(a_odd, zero)),
+            _mm_add_epi16(_mm_unpacklo_epi8(b_even, zero), _mm_unpacklo_epi8(b_odd, zero)));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a_even, zero), _mm_unpackhi_epi8(a_odd, zero)),
+            _mm_add_epi16(_mm_unpackhi_epi8(b_even, zero), _mm_unpackhi_epi8(b_odd, zero)));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+        _mm_storeu_si128((__m128i*)(out + x * 4), _mm_packus_epi16(lo, hi));
+    }
+#endif
+
+    for (; x < out_width; ++x) {
+        int left = 2 * x * 4, right = std::min(2 * x + 1, width - 1) * 4;
+        for (int c = 0; c < 4; ++c)
+            out[x * 4 + c] = png_byte((a[left + c] + a[right + c] + b[left + c] + b[right + c] + 2) >> 2);
+    }
+}
+
+// out[x] = [1 2 1] around column 2x of the [1 2 1] sum of rows a, b, c.
+// The column sums go through sums, 16-bit with the edge pixels repeated
+// on both sides, which needs room for width + 3 pixels.
+inline void reduce_tent_row(png_const_bytep a, png_const_bytep b, png_const_bytep c, png_bytep out, int width, int out_width, uint16_t* sums) {
+    uint16_t* s = sums + 4;
+    int x = 0;
+
+#ifdef PIXEL_OPS_SSE2
+    __m128i const zero = _mm_setzero_si128();
+    for (; x + 4 <= width; x += 4) {
+        __m128i va = _mm_loadu_si128((__m128i const*)(a + x * 4));
+        __m128i vb = _mm_loadu_si128((__m128i const*)(b + x * 4));
+        __m128i vc = _mm_loadu_si128((__m128i const*)(c + x * 4));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vc, zero)), _mm_slli_epi16(_mm_unpacklo_epi8(vb, zero), 1));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vc, zero)), _mm_slli_epi16(_mm_unpackhi_epi8(vb, zero), 1));
+        _mm_storeu_si128((__m128i*)(s + x * 4), lo);
+        _mm_storeu_si128((__m128i*)(s + x * 4 + 8), hi);
+    }
+#endif
+    for (int i = x * 4; i < width * 4; ++i)
+        s[i] = uint16_t(a[i] + 2 * b[i] + c[i]);
+
+    for (int i = 0; i < 4; ++i) {
+        s[i - 4] = s[i];
+        s[width * 4 + i] = s[width * 4 + 4 + i] = s[(width - 1) * 4 + i];
+    }
+
+    x = 0;
+#ifdef PIXEL_OPS_SSE2
+    // Low half: s[2x - 1] + s[2x + 1] + 2 s[2x], four channels
+    __m128i const eight = _mm_set1_epi16(8);
+    for (; x < out_width; ++x) {
+        __m128i left = _mm_loadu_si128((__m128i const*)(s + (2 * x - 1) * 4));
+        __m128i right = _mm_loadu_si128((__m128i const*)(s + (2 * x + 1) * 4));
+        __m128i v = _mm_add_epi16(_mm_add_epi16(left, right), _mm_slli_epi16(_mm_srli_si128(left, 8), 1));
+        v = _mm_srli_epi16(_mm_add_epi16(v, eight), 4);
+        *(int*)(out + x * 4) = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+    }
+#endif
+    for (; x < out_width; ++x)
+        for (int i = 0; i < 4; ++i)
+            out[x * 4 + i] = png_byte((s[(2 * x - 1) * 4 + i] + 2 * s[2 * x * 4 + i] + s[(2 * x + 1) * 4 + i] + 8) >> 4);
+}
+
+class ImagePyramid {
+public:
+    struct Level {
+        int width, height;
+        png_bytep pixels;
+
+        png_bytep row(int y) const {
+            return pixels + size_t(y) * width * 4;
+        }
+    };
+
+private:
+    std::unique_ptr<png_byte[]> m_storage;
+    size_t m_bytes = 0;
+    std::vector<Level> m_levels;
+    PyramidFilter m_filter = PYRAMID_BOX;
+
+    // Row y of level k + 1 from the rows of level k
+    void _reduce(int k, int y, std::vector<uint16_t>& sums) {
+        Level const& in = m_levels[k];
+        Level const& out = m_levels[k + 1];
+        png_const_bytep below = in.row(std::min(2 * y + 1, in.height - 1));
+
+        if (m_filter == PYRAMID_BOX) {
+            reduce_box_row(in.row(2 * y), below, out.row(y), in.width, out.width);
+        } else {
+            sums.resize(size_t(in.width + 3) * 4);
+            reduce_tent_row(in.row(std::max(2 * y - 1, 0)), in.row(2 * y), below, out.row(y), in.width, out.width, sums.data());
+        }
+    }
+
+    // Level 0 rows [from, to) and every row of levels 1 to depth that they
+    // complete, in order
+    void _stream(Image const& src, int from, int to, int depth) {
+        std::vector<uint16_t> sums;
+        for (int y = from; y < to; ++y) {
+            png_bytep dst = m_levels[0].row(y);
+            png_const_bytep stored = src.row(y, dst);
+            if (stored != dst)
+                std::copy_n(stored, size_t(src.width) * 4, dst);
+
+            // Row j below needs rows up to 2j + 1 (the last row at the end)
+            int row = y;
+            for (int k = 0; k < depth && (row % 2 == 1 || row == m_levels[k].height - 1); ++k) {
+                row /= 2;
+                _reduce(k, row, sums);
+            }
+        }
+    }
+
+public:
+    ImagePyramid() {}
+
+    ImagePyramid(Image const& src, PyramidFilter filter = PYRAMID_BOX) {
+        build(src, filter);
+    }
+
+    void build(Image const& src, PyramidFilter filter = PYRAMID_BOX) {
+        m_filter = filter;
+        m_levels.clear();
+
+        // No pixels, nothing to reduce: level 0 alone, with the source size
+        if (src.width == 0 || src.height == 0) {
+            m_levels.push_back({ src.width, src.height, nullptr });
+            return;
+        }
+
+        size_t total = 0;
+        int width = src.width, height = src.height;
+        for (;;) {
+            m_levels.push_back({ width, height, nullptr });
+            total += size_t(width) * height * 4;
+            if (width == 1 && height == 1)
+                break;
+            width = (width + 1) / 2, height = (height + 1) / 2;
+        }
+
+        // Rebuilding at the same size keeps the storage
+        if (!m_storage || m_bytes != total) {
+            m_bytes = total;
+            m_storage.reset(new png_byte[total]);
+        }
+        png_bytep next = m_storage.get();
+        for (Level& level : m_levels) {
+            level.pixels = next;
+            next += size_t(level.width) * level.height * 4;
+        }
+
+        // Bands of 2^depth source rows stream independently down to level
+        // depth. Tent rows also read the row above their band, so with
+        // several threads the tent streams only level 0.
+        int const last = levels() - 1;
+        int threads = std::max(1, int(std::thread::hardware_concurrency()));
+        int depth = last;
+        if (threads > 1) {
+            depth = 0;
+            if (m_filter == PYRAMID_BOX)
+                while (depth < last && (src.height >> (depth + 1)) >= threads)
+                    ++depth;
+        }
+
+        int band = 1 << depth;
+        parallel_for(0, (src.height + band - 1) / band, [&](int from, int to) {
+            _stream(src, from * band, std::min(to * band, src.height), depth);
+        });
+
+        // The rest level by level
+        for (int k = depth; k < last; ++k)
+            parallel_for(0, m_levels[k + 1].height, [&](int from, int to) {
+                std::vector<uint16_t> sums;
+                for (int y = from; y < to; ++y)
+                    _reduce(k, y, sums);
+            }, 16);
+    }
+
+    int levels() const {
+        return int(m_levels.size());
+    }
+
+    Level const& level(int k) const {
+        return m_levels[k];
+    }
+
+    // Level k as a separate image
+    void copy_level(int k, Image& out) const {
+        Level const& in = m_levels[k];
+        if (!out.pixels || out.width != in.width || out.height != in.height)
+            out.create(in.width, in.height);
+        out.materialize();
+
+        for (int y = 0; y < in.height; ++y)
+            std::copy_n(in.row(y), size_t(in.width) * 4, out.pixels[y]);
+    }
+
+    // Smallest level still covering width x height, level 0 if none does
+    int level_for(int width, int height) const {
+        int k = 0;
+        while (k + 1 < levels() && m_levels[k + 1].width >= width && m_levels[k + 1].height >= height)
+            ++k;
+        return k;
+    }
+
+    size_t total_bytes() const {
+        return m_bytes;
+    }
+};
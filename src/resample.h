@@ -0,0 +1,316 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include "png_files.h"
+#include "parallel.h"
+#include "pixel_ops.h"
+#include "convolution.h"
+
+// Separable resizing of RGBA images. One pass scales the rows, the other
+// the columns, with a byte image in between; whichever order costs fewer
+// multiply-adds runs. Every output column (and row) has its weights
+// computed once, as 16-bit fixed point, so inner loops are pmaddwd.
+//
+// When downscaling the filter is stretched by the scale factor so every
+// input pixel contributes. AREA is a box of exactly the output pixel's
+// footprint, the average of the covered source area: input pixels on its
+// edges weigh by how much of them it covers. Channels are filtered
+// independently, colour is not premultiplied by alpha.
+
+enum ResampleFilter {
+    NEAREST,
+    BILINEAR,
+    BICUBIC,
+    LANCZOS3,
+    AREA,
+};
+
+// Fractional bits of the weights
+const int RESAMPLE_BITS = 14;
+
+// Half width of the filter at scale 1
+inline double resample_support(ResampleFilter filter) {
+    switch (filter) {
+    case BILINEAR: return 1.0;
+    case BICUBIC: return 2.0;
+    case LANCZOS3: return 3.0;
+    default: return 0.5;
+    }
+}
+
+inline double resample_filter(ResampleFilter filter, double x) {
+    auto sinc = [](double x) {
+        if (x == 0.0)
+            return 1.0;
+        x *= 3.14159265358979323846;
+        return std::sin(x) / x;
+    };
+
+    switch (filter) {
+    case BILINEAR:
+        x = std::fabs(x);
+        return x < 1.0 ? 1.0 - x : 0.0;
+    case BICUBIC: {
+        // Keys, a = -0.5
+        double const a = -0.5;
+        x = std::fabs(x);
+        if (x < 1.0)
+            return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+        if (x < 2.0)
+            return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+        return 0.0;
+    }
+    case LANCZOS3:
+        return std::fabs(x) < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+    default:
+        return x >= -0.5 && x < 0.5 ? 1.0 : 0.0;
+    }
+}
+
+// Weights of every output position along one axis:
+//
+//     out[i] = sum over k < taps of weights[i * taps + k] * in[start[i] + k]
+//
+// The weights of an output add up to exactly 1 << RESAMPLE_BITS. taps is
+// even, unused taps have weight 0. start[i] + taps never passes the input
+// end unless the input is shorter than taps; span is the largest of them.
+struct ResampleWeights {
+    int taps = 0, span = 0;
+    std::vector<int> start;
+    std::vector<int16_t> weights;
+
+    ResampleWeights(int in, int out, ResampleFilter filter) : start(out) {
+        double scale = double(in) / out;
+        double stretch = std::max(scale, 1.0);
+        double support = resample_support(filter) * stretch;
+
+        taps = int(std::ceil(support)) * 2 + 1;
+        taps += taps & 1;
+        weights.assign(size_t(out) * taps, 0);
+
+        std::vector<double> w(taps);
+        for (int i = 0; i < out; ++i) {
+            double center = (i + 0.5) * scale;
+            int from = std::max(int(center - support + 0.5), 0);
+            int to = std::min(int(center + support + 0.5), in);
+
+            // Every input pixel the footprint [left, right) touches, weighed
+            // by the overlap. At most ceil(scale) + 1 of them, within taps.
+            double left = i * scale, right = (i + 1) * scale;
+            if (filter == AREA) {
+                from = std::max(int(std::floor(left)), 0);
+                to = std::min(int(std::ceil(right)), in);
+            }
+
+            double total = 0;
+            std::fill(w.begin(), w.end(), 0.0);
+            for (int k = 0; k < to - from; ++k) {
+                if (filter == AREA)
+                    w[k] = std::max(0.0, std::min(from + k + 1.0, right) - std::max(double(from + k), left));
+                else
+                    w[k] = resample_filter(filter, (from + k - center + 0.5) / stretch);
+                total += w[k];
+            }
+
+            // Nothing under a box that fell between two inputs
+            if (total == 0.0) {
+                from = std::min(int(center), in - 1);
+                w[0] = total = 1.0;
+            }
+
+            // Keep the taps inside the input by shifting the window left
+            int shift = std::max(0, std::min(from + taps - in, from));
+            from -= shift;
+            std::rotate(w.begin(), w.end() - shift, w.end());
+
+            start[i] = from;
+            span = std::max(span, from + taps);
+            _quantize(w, total, &weights[size_t(i) * taps]);
+        }
+    }
+
+    // Rounded weights, the rounding error goes to the largest one
+    void _quantize(std::vector<double> const& w, double total, int16_t* out) {
+        int sum = 0, largest = 0;
+        for (int k = 0; k < taps; ++k) {
+            out[k] = int16_t(std::lround(w[k] / total * (1 << RESAMPLE_BITS)));
+            sum += out[k];
+            if (std::abs(out[k]) > std::abs(out[largest]))
+                largest = k;
+        }
+        out[largest] += (1 << RESAMPLE_BITS) - sum;
+    }
+};
+
+// Fixed point sums back to bytes, rounded and clamped, 16 values at a
+// time with SSE2
+inline void store_fixed(png_bytep row_out, int const* sums, int n) {
+    int const half = 1 << (RESAMPLE_BITS - 1);
+    int i = 0;
+
+#ifdef PIXEL_OPS_SSE2
+    __m128i v_half = _mm_set1_epi32(half);
+    auto load = [&](int k) {
+        __m128i v = _mm_loadu_si128((__m128i const*)(sums + i + k * 4));
+        return _mm_srai_epi32(_mm_add_epi32(v, v_half), RESAMPLE_BITS);
+    };
+    for (; i + 16 <= n; i += 16) {
+        __m128i low = _mm_packs_epi32(load(0), load(1));
+        __m128i high = _mm_packs_epi32(load(2), load(3));
+        _mm_storeu_si128((__m128i*)(row_out + i), _mm_packus_epi16(low, high));
+    }
+#endif
+
+    for (; i < n; ++i)
+        row_out[i] = png_byte(std::min(std::max((sums[i] + half) >> RESAMPLE_BITS, 0), 255));
+}
+
+// One output row of the horizontal pass. in holds at least weights.span
+// pixels. With SSE2 the two pixels of a tap pair are interleaved channel
+// by channel, so one pmaddwd weighs both.
+inline void resample_row(png_const_bytep in, png_bytep out, ResampleWeights const& weights, int width) {
+    int const taps = weights.taps, half = 1 << (RESAMPLE_BITS - 1);
+
+    for (int x = 0; x < width; ++x) {
+        int16_t const* w = &weights.weights[size_t(x) * taps];
+        png_const_bytep px = in + size_t(weights.start[x]) * 4;
+
+#ifdef PIXEL_OPS_SSE2
+        __m128i const zero = _mm_setzero_si128();
+        __m128i sum = _mm_set1_epi32(half);
+        for (int k = 0; k < taps; k += 2) {
+            __m128i a = _mm_cvtsi32_si128(*(int const*)(px + k * 4));
+            __m128i b = _mm_cvtsi32_si128(*(int const*)(px + k * 4 + 4));
+            __m128i pair = _mm_unpacklo_epi8(_mm_unpacklo_epi8(a, b), zero);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(pair, _mm_set1_epi32(*(int const*)(w + k))));
+        }
+        sum = _mm_srai_epi32(sum, RESAMPLE_BITS);
+        sum = _mm_packs_epi32(sum, sum);
+        *(int*)(out + x * 4) = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+#else
+        int sum[4] = { half, half, half, half };
+        for (int k = 0; k < taps; ++k)
+            for (int c = 0; c < 4; ++c)
+                sum[c] += w[k] * px[k * 4 + c];
+        for (int c = 0; c < 4; ++c)
+            out[x * 4 + c] = png_byte(std::min(std::max(sum[c] >> RESAMPLE_BITS, 0), 255));
+#endif
+    }
+}
+
+// Rows of src to out.width columns, rows split across threads
+inline void resample_horizontal(Image const& src, Image& out, ResampleWeights const& weights) {
+    parallel_for(0, out.height, [&](int from, int to) {
+        // Room past the end for inputs shorter than the filter, left zero
+        std::vector<png_byte> scratch(size_t(std::max(weights.span, src.width)) * 4);
+        bool padded = weights.span > src.width;
+
+        for (int y = from; y < to; ++y) {
+            png_const_bytep row = src.row(y, scratch.data());
+            if (padded && row != scratch.data())
+                std::copy(row, row + size_t(src.width) * 4, scratch.begin());
+            resample_row(padded ? scratch.data() : row, out.pixels[y], weights, out.width);
+        }
+    }, 16);
+}
+
+// Columns of src to out.height rows. src has no pending orientation.
+// Every output row is a weighted sum of whole input rows, done in chunks
+// that stay in L1 like the separable convolution.
+inline void resample_vertical(Image const& src, Image& out, ResampleWeights const& weights) {
+    int const n = out.width * 4;
+
+    parallel_for(0, out.height, [&](int from, int to) {
+        std::vector<int> sums(CONVOLUTION_CHUNK);
+        std::vector<Tap<png_byte>> taps;
+
+        for (int y = from; y < to; ++y) {
+            taps.clear();
+            int16_t const* w = &weights.weights[size_t(y) * weights.taps];
+            for (int k = 0; k < weights.taps; ++k)
+                if (w[k])
+                    taps.push_back({ src.pixels[weights.start[y] + k], w[k] });
+
+            for (int i = 0; i < n; i += CONVOLUTION_CHUNK) {
+                int len = std::min(CONVOLUTION_CHUNK, n - i);
+                sum_taps(sums.data(), taps.data(), int(taps.size()), i, len, true);
+                store_fixed(out.pixels[y] + i, sums.data(), len);
+            }
+        }
+    }, 8);
+}
+
+inline void resize_nearest(Image const& src, Image& out) {
+    std::vector<int> columns(out.width);
+    for (int x = 0; x < out.width; ++x)
+        columns[x] = std::min(int((x + 0.5) * src.width / out.width), src.width - 1);
+
+    parallel_for(0, out.height, [&](int from, int to) {
+        std::vector<png_byte> scratch(size_t(src.width) * 4);
+        for (int y = from; y < to; ++y) {
+            int row = std::min(int((y + 0.5) * src.height / out.height), src.height - 1);
+            uint32_t const* in = (uint32_t const*)src.row(row, scratch.data());
+            uint32_t* px = (uint32_t*)out.pixels[y];
+            for (int x = 0; x < out.width; ++x)
+                px[x] = in[columns[x]];
+        }
+    }, 16);
+}
+
+// out = src scaled to width x height. out is (re)allocated unless it
+// already has that size; it cannot be src.
+inline void resize(Image const& src, Image& out, int width, int height, ResampleFilter filter = BICUBIC) {
+    if (&src == &out || width <= 0 || height <= 0) abort();
+
+    if (!out.pixels || out.width != width || out.height != height)
+        out.create(width, height);
+    out.materialize();
+
+    if (filter == NEAREST) {
+        resize_nearest(src, out);
+        return;
+    }
+
+    // A pass that keeps the size is the identity
+    bool scale_x = width != src.width, scale_y = height != src.height;
+    if (!scale_x && !scale_y) {
+        resize_nearest(src, out);
+        return;
+    }
+
+    ResampleWeights columns(src.width, width, filter);
+    ResampleWeights rows(src.height, height, filter);
+
+    if (!scale_y) {
+        resample_horizontal(src, out, columns);
+        return;
+    }
+
+    // Multiply-adds of each order. The vertical pass needs stored rows, so
+    // an image with pending orientation always starts horizontally.
+    double horizontal_first = double(width) * src.height * columns.taps * scale_x + double(width) * height * rows.taps;
+    double vertical_first = double(src.width) * height * rows.taps + double(width) * height * columns.taps * scale_x;
+
+    Image between;
+    if (src.orientation != ORIENT_IDENTITY || horizontal_first <= vertical_first) {
+        if (!scale_x) {
+            // Only the vertical pass, through an unoriented copy
+            between.create(src.width, src.height);
+            resize_nearest(src, between);
+        } else {
+            between.create(width, src.height);
+            resample_horizontal(src, between, columns);
+        }
+        resample_vertical(between, out, rows);
+    } else {
+        if (!scale_x) {
+            resample_vertical(src, out, rows);
+            return;
+        }
+        between.create(src.width, height);
+        resample_vertical(src, between, rows);
+        resample_horizontal(between, out, columns);
+    }
+}